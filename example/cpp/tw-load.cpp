@@ -0,0 +1,118 @@
+// A load generator for the example Haberdasher service. It uses the generated client and the regular
+// httplib requester, so the measurements include the whole client stack.
+//
+// Usage: twirp-load --corpus <file> [--format json|text] [--url http://localhost:8080] [--method MakeHat]
+//     [--concurrency 8] [--rate 0] [--duration 10] [--json] [--header Name:Value]...
+//
+// `--rate` selects the open-loop mode with the given number of requests per second, the default
+// closed-loop mode sends requests as fast as the `--concurrency` workers get the responses.
+#include <twirp/httplib/client-helper.h>
+#include <twirp/load-generator.h>
+#include "service_client.hpp"
+
+using namespace twitch::twirp::example;
+
+struct Flags {
+    std::string url_ = "http://localhost:8080";
+    std::string method_ = "MakeHat";
+    std::string corpus_;
+    trpc::CorpusFormat format_ = trpc::CorpusFormat::kJson;
+    bool json_ = false;
+    std::vector<std::pair<std::string, std::string>> headers_;
+    trpc::LoadOptions options_;
+};
+
+static void usage() {
+    std::cerr << "Usage: twirp-load --corpus <file> [--format json|text] [--url http://localhost:8080] "
+                 "[--method MakeHat] [--concurrency 8] [--rate 0] [--duration 10] [--json] "
+                 "[--header Name:Value]..." << std::endl;
+    exit(2);
+}
+
+static Flags parseFlags(int argc, char **argv) {
+    Flags res;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json") {
+            res.json_ = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage();
+        }
+        std::string val = argv[++i];
+        if (arg == "--url") {
+            res.url_ = val;
+        } else if (arg == "--method") {
+            res.method_ = val;
+        } else if (arg == "--corpus") {
+            res.corpus_ = val;
+        } else if (arg == "--format") {
+            res.format_ = val == "text" ? trpc::CorpusFormat::kText : trpc::CorpusFormat::kJson;
+        } else if (arg == "--concurrency") {
+            res.options_.concurrency_ = std::stoul(val);
+        } else if (arg == "--rate") {
+            res.options_.rate_ = std::stod(val);
+        } else if (arg == "--duration") {
+            res.options_.duration_ = absl::Seconds(std::stod(val));
+        } else if (arg == "--header") {
+            auto pos = val.find(':');
+            if (pos == std::string::npos) {
+                usage();
+            }
+            res.headers_.emplace_back(val.substr(0, pos), val.substr(pos + 1));
+        } else {
+            usage();
+        }
+    }
+    if (res.corpus_.empty() || res.options_.concurrency_ == 0) {
+        usage();
+    }
+    return res;
+}
+
+// Create the call function for one worker. Each worker gets its own requester (and so its
+// own connection), the corpus is shared and is cycled through in order.
+template<class Req, class Resp> std::function<trpc::LoadCall(size_t)> makeCalls(const Flags &flags,
+    std::shared_ptr<std::vector<Req>> corpus,
+    absl::StatusOr<Resp*> (HaberdasherClient::*method)(google::protobuf::Arena*, void*, const Req*)) {
+
+    return [&flags, corpus, method](size_t) -> trpc::LoadCall {
+        trpc::ClientMiddlewares middlewares;
+        for (const auto &h : flags.headers_) {
+            middlewares.push_back(trpc::SetHeaderMiddleware::make(std::string(h.first), std::string(h.second)));
+        }
+        auto requester = std::make_shared<trpc::HttplibRequester>(flags.url_, std::move(middlewares));
+        // Label the server errors with their codes and the connection failures with "client:"
+        requester->SetMarkServerErrors(true);
+        auto client = std::make_shared<HaberdasherClient>(requester, flags.json_);
+
+        return [client, corpus, method](size_t seq) {
+            google::protobuf::Arena arena;
+            const Req &req = (*corpus)[seq % corpus->size()];
+            return ((*client).*method)(&arena, nullptr, &req).status();
+        };
+    };
+}
+
+int main(int argc, char **argv) {
+    Flags flags = parseFlags(argc, argv);
+
+    std::function<trpc::LoadCall(size_t)> calls;
+    if (flags.method_ == "MakeHat") {
+        auto corpus = trpc::LoadCorpus<Size>(flags.corpus_, flags.format_);
+        if (!corpus.ok()) {
+            std::cerr << corpus.status() << std::endl;
+            return 1;
+        }
+        calls = makeCalls(flags, std::make_shared<std::vector<Size>>(std::move(corpus.value())),
+            &HaberdasherClient::MakeHat);
+    } else {
+        std::cerr << "Unknown method: " << flags.method_ << std::endl;
+        return 2;
+    }
+
+    trpc::LoadReport report = trpc::RunLoad(flags.options_, calls);
+    report.Print(std::cout);
+    return 0;
+}
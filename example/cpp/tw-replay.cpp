@@ -0,0 +1,104 @@
+// A replay tool for the traffic captured by the example server (run `webserver <capture file>`). The captured
+// requests are sent to the server at the original timing (or faster/slower with `--speed`), and the per-method
+// latencies can be saved and compared with the run of another build.
+//
+// Usage: twirp-replay --log <file> [--url http://localhost:8080] [--concurrency 8] [--speed 1]
+//     [--save <summary file>] [--baseline <summary file>] [--header Name:Value]...
+//
+// `--speed 0` sends the requests as fast as possible. The replay doesn't need the generated code, so it
+// works for any service.
+#include <twirp/httplib/client-helper.h>
+#include <twirp/replay.h>
+#include <fstream>
+#include <iostream>
+
+struct Flags {
+    std::string url_ = "http://localhost:8080";
+    std::string log_;
+    std::string save_;
+    std::string baseline_;
+    std::vector<std::pair<std::string, std::string>> headers_;
+    trpc::ReplayOptions options_;
+};
+
+static void usage() {
+    std::cerr << "Usage: twirp-replay --log <file> [--url http://localhost:8080] [--concurrency 8] [--speed 1] "
+                 "[--save <summary file>] [--baseline <summary file>] [--header Name:Value]..." << std::endl;
+    exit(2);
+}
+
+static Flags parseFlags(int argc, char **argv) {
+    Flags res;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+        }
+        std::string val = argv[++i];
+        if (arg == "--url") {
+            res.url_ = val;
+        } else if (arg == "--log") {
+            res.log_ = val;
+        } else if (arg == "--save") {
+            res.save_ = val;
+        } else if (arg == "--baseline") {
+            res.baseline_ = val;
+        } else if (arg == "--concurrency") {
+            res.options_.concurrency_ = std::stoul(val);
+        } else if (arg == "--speed") {
+            res.options_.speed_ = std::stod(val);
+        } else if (arg == "--header") {
+            auto pos = val.find(':');
+            if (pos == std::string::npos) {
+                usage();
+            }
+            res.headers_.emplace_back(val.substr(0, pos), val.substr(pos + 1));
+        } else {
+            usage();
+        }
+    }
+    if (res.log_.empty() || res.options_.concurrency_ == 0 || res.options_.speed_ < 0) {
+        usage();
+    }
+    return res;
+}
+
+int main(int argc, char **argv) {
+    Flags flags = parseFlags(argc, argv);
+
+    auto reader = trpc::CaptureReader::Open(flags.log_);
+    if (!reader.ok()) {
+        std::cerr << reader.status() << std::endl;
+        return 1;
+    }
+    std::cout << "Replaying " << reader.value()->Records().size() << " requests" << std::endl;
+
+    // Each worker gets its own requester (and so its own connection)
+    trpc::ReplayReport report = trpc::RunReplay(reader.value()->Records(), flags.options_, [&flags](size_t) {
+        trpc::ClientMiddlewares middlewares;
+        for (const auto &h : flags.headers_) {
+            middlewares.push_back(trpc::SetHeaderMiddleware::make(std::string(h.first), std::string(h.second)));
+        }
+        auto requester = std::make_shared<trpc::HttplibRequester>(flags.url_, std::move(middlewares));
+        requester->SetMarkServerErrors(true);
+        return trpc::MakeRequesterReplay(requester);
+    });
+    report.Print(std::cout);
+
+    trpc::ReplaySummary summary = report.Summarize();
+    if (!flags.save_.empty()) {
+        std::ofstream out(flags.save_);
+        trpc::SaveReplaySummary(summary, out);
+    }
+    if (!flags.baseline_.empty()) {
+        std::ifstream in(flags.baseline_);
+        auto baseline = trpc::LoadReplaySummary(in);
+        if (!baseline.ok()) {
+            std::cerr << baseline.status() << std::endl;
+            return 1;
+        }
+        std::cout << "Compared with " << flags.baseline_ << ":\n";
+        trpc::PrintReplayDiff(baseline.value(), summary, std::cout);
+    }
+    return 0;
+}
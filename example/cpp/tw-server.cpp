@@ -81,7 +81,8 @@ public:
     }
 };
 
-int main() {
+// Pass a file name to capture the requests, they can be replayed with `twirp-replay`.
+int main(int argc, char **argv) {
     httplib::Server srv;
     srv.set_logger([](const httplib::Request &req, const httplib::Response &resp) -> void {
         printf("Request received: %s, resp=%d\n", req.path.c_str(), resp.status);
@@ -92,11 +93,24 @@ int main() {
     // Create the host (it's an adapter for the service impl)
     twitch::twirp::example::HaberdasherServiceHost host(impl);
 
+    trpc::ServerOptions options;
+    if (argc > 1) {
+        auto capture = trpc::CaptureLog::Create(argv[1]);
+        if (!capture.ok()) {
+            fprintf(stderr, "%s\n", capture.status().ToString().c_str());
+            return 1;
+        }
+        options.capture_ = std::move(capture.value());
+    }
+
     // Register the Twirp service handlers in the HTTP service
     trpc::RegisterTwirpHandlers(&host, &srv,trpc::ServerMiddlewares{
-        // Add middleware here. We have the authentication middleware only for now.
+        // Add middleware here. The authentication middleware goes first, it sets the principal.
         std::make_shared<AuthenticationMiddleware>(),
-    });
+        // Limit each user to 100 requests per second, the anonymous requests share a single bucket.
+        trpc::RateLimitMiddleware<AuthenticationData>::make(trpc::RateLimiterOptions(),
+            [](const Principal &principal) { return std::string_view(principal.username_); }),
+    }, options);
 
     // And start listening!
     srv.listen("0.0.0.0", 8080);
@@ -0,0 +1,225 @@
+// This file contains the traffic capture log for Twirp servers. The sampled requests are appended to
+// a preallocated memory-mapped file and can be replayed later with the tools from replay.h.
+#pragma once
+
+#include <twirp/rpc-defs.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/time/clock.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <span>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace trpc {
+
+// The header at the start of the capture log file
+struct CaptureLogHeader {
+    static constexpr uint64_t Magic = 0x3170616354777454ull; // "TtwTcap1"
+    // The records start at this offset
+    static constexpr uint64_t DataOffset = 64;
+
+    uint64_t magic_;
+    // The capacity of the record area in bytes
+    uint64_t capacity_;
+    // The end of the reserved part of the record area
+    std::atomic<uint64_t> tail_;
+    // The number of records that didn't fit into the log
+    std::atomic<uint64_t> dropped_;
+    // The end of the last committed record, the records before it have their sizes written
+    // unless their writer has died
+    std::atomic<uint64_t> committedEnd_;
+};
+
+// The fixed-size part of a record. It's followed by the service and method names, the context entries
+// (each as the key and value sizes followed by the key and value) and the request body. Records are
+// aligned to 8 bytes.
+struct CaptureRecordHeader {
+    // The total size of the record including the padding, written right after the reservation
+    std::atomic<uint32_t> size_;
+    // Set after the record is completely written
+    std::atomic<uint32_t> committed_;
+    // The time when the request was received (ns since the Unix epoch)
+    int64_t timestampNs_;
+    uint16_t serviceSize_;
+    uint16_t methodSize_;
+    uint32_t contextSize_;
+    uint32_t bodySize_;
+    uint32_t json_;
+};
+
+// Settings for the CaptureLog
+struct CaptureOptions {
+    // The size of the log file, it's allocated upfront. Records that don't fit are dropped.
+    size_t capacity_ = 1024 * 1024 * 1024;
+    // Capture one request out of this many on each thread
+    uint32_t sampleEvery_ = 1;
+};
+
+// An append-only log of the captured requests. Writers reserve the space for their records with
+// a single atomic operation and copy them into the mapping, so capturing doesn't serialize the
+// request handlers. The file is truncated to the used size when the log is destroyed.
+class CaptureLog {
+    static uint64_t NextLogId() {
+        static std::atomic<uint64_t> counter = 0;
+        return ++counter;
+    }
+
+    const uint64_t id_ = NextLogId();
+    int fd_;
+    char *data_;
+    size_t mappedSize_;
+    std::atomic<uint32_t> sampleEvery_;
+
+    CaptureLog(int fd, char *data, size_t mappedSize, uint32_t sampleEvery) :
+        fd_(fd), data_(data), mappedSize_(mappedSize), sampleEvery_(sampleEvery) {}
+
+    CaptureLogHeader *Header() const {
+        return reinterpret_cast<CaptureLogHeader*>(data_);
+    }
+
+    static size_t Padded(size_t size) {
+        return (size + 7) & ~size_t(7);
+    }
+
+    static void Put(char *&pos, const void *src, size_t size) {
+        memcpy(pos, src, size);
+        pos += size;
+    }
+
+public:
+    ~CaptureLog() {
+#ifndef _WIN32
+        uint64_t used = std::min(Header()->tail_.load(), Header()->capacity_);
+        munmap(data_, mappedSize_);
+        if (ftruncate(fd_, static_cast<off_t>(CaptureLogHeader::DataOffset + used)) != 0) {
+            // The log is still readable, it just keeps the unused space
+        }
+        close(fd_);
+#endif
+    }
+
+    CaptureLog(const CaptureLog&) = delete; // non construction-copyable
+    CaptureLog& operator = (const CaptureLog&) = delete; // non copyable
+
+    // Create the log file, an existing file is overwritten. The log contains the request bodies, so
+    // it's only readable by the owner.
+    static absl::StatusOr<std::shared_ptr<CaptureLog>> Create(const std::string &path,
+        const CaptureOptions &options = CaptureOptions()) {
+#ifdef _WIN32
+        return absl::UnimplementedError("Traffic capture is not supported");
+#else
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            return absl::UnavailableError("Can't create the capture log " + path + ": " + strerror(errno));
+        }
+        // An existing file keeps its mode on open
+        if (fchmod(fd, 0600) != 0) {
+            close(fd);
+            return absl::UnavailableError("Can't restrict the capture log " + path + ": " + strerror(errno));
+        }
+        size_t size = CaptureLogHeader::DataOffset + options.capacity_;
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            close(fd);
+            return absl::ResourceExhaustedError("Can't allocate the capture log " + path + ": " + strerror(errno));
+        }
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return absl::ResourceExhaustedError("Can't map the capture log " + path + ": " + strerror(errno));
+        }
+
+        auto *header = new (addr) CaptureLogHeader();
+        header->magic_ = CaptureLogHeader::Magic;
+        header->capacity_ = options.capacity_;
+        return std::shared_ptr<CaptureLog>(new CaptureLog(fd, static_cast<char*>(addr), size, options.sampleEvery_));
+#endif
+    }
+
+    // Change the sampling rate, 0 stops the capture
+    void SetSampleEvery(uint32_t sampleEvery) {
+        sampleEvery_.store(sampleEvery, std::memory_order_relaxed);
+    }
+
+    // Decide if the current request should be captured
+    bool Sample() {
+        uint32_t every = sampleEvery_.load(std::memory_order_relaxed);
+        if (every == 0) {
+            return false;
+        }
+        // The per-thread counters are kept for each log, so the logs don't sample each other's requests
+        thread_local absl::flat_hash_map<uint64_t, uint64_t> counters;
+        return ++counters[id_] % every == 0;
+    }
+
+    // Append the request to the log. The string values of the context are captured with their keys,
+    // only the keys are captured for the values of other types.
+    void Append(absl::Time received, std::string_view service, std::string_view method, bool json,
+        const RequestContext &context, std::span<const char> body) {
+
+        std::vector<std::pair<std::string_view, std::string_view>> entries;
+        size_t contextSize = 0;
+        context.ForEachItem([&](std::string_view key, const std::any &value) {
+            const auto *str = std::any_cast<std::string>(&value);
+            entries.emplace_back(key, str ? std::string_view(*str) : std::string_view());
+            contextSize += 2 * sizeof(uint32_t) + key.size() + entries.back().second.size();
+            return true;
+        });
+
+        size_t size = Padded(sizeof(CaptureRecordHeader) + service.size() + method.size() + contextSize + body.size());
+        CaptureLogHeader *header = Header();
+        if (size > UINT32_MAX) {
+            header->dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        uint64_t offset = header->tail_.fetch_add(size, std::memory_order_relaxed);
+        if (offset + size > header->capacity_) {
+            header->dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        char *start = data_ + CaptureLogHeader::DataOffset + offset;
+        auto *record = reinterpret_cast<CaptureRecordHeader*>(start);
+        // Publish the size first, so that the readers can skip the record while it's being written
+        record->size_.store(static_cast<uint32_t>(size), std::memory_order_release);
+        record->timestampNs_ = absl::ToUnixNanos(received);
+        record->serviceSize_ = static_cast<uint16_t>(service.size());
+        record->methodSize_ = static_cast<uint16_t>(method.size());
+        record->contextSize_ = static_cast<uint32_t>(contextSize);
+        record->bodySize_ = static_cast<uint32_t>(body.size());
+        record->json_ = json;
+
+        char *pos = start + sizeof(CaptureRecordHeader);
+        Put(pos, service.data(), service.size());
+        Put(pos, method.data(), method.size());
+        for (const auto &[key, value] : entries) {
+            uint32_t sizes[2] = {static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())};
+            Put(pos, sizes, sizeof(sizes));
+            Put(pos, key.data(), key.size());
+            Put(pos, value.data(), value.size());
+        }
+        Put(pos, body.data(), body.size());
+        record->committed_.store(1, std::memory_order_release);
+
+        uint64_t end = offset + size;
+        uint64_t committedEnd = header->committedEnd_.load(std::memory_order_relaxed);
+        while (committedEnd < end && !header->committedEnd_.compare_exchange_weak(committedEnd, end,
+            std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    // The number of records that didn't fit into the log
+    uint64_t Dropped() const {
+        return Header()->dropped_.load(std::memory_order_relaxed);
+    }
+};
+
+} // namespace trpc
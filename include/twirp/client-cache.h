@@ -0,0 +1,179 @@
+// This file contains the memoizing response cache for the generated Twirp clients. The cache is used
+// only for the methods that are marked with `option idempotency_level = NO_SIDE_EFFECTS;` in the
+// Protobuf schema, and only if it's passed to the client constructor.
+#pragma once
+
+#include <twirp/rpc-defs.h>
+#include <absl/cleanup/cleanup.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/hash/hash.h>
+#include <absl/time/clock.h>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+
+namespace trpc {
+
+// Settings for the ResponseCache.
+struct ResponseCacheOptions {
+    // The maximum total size of the cached responses and their keys, in bytes. It's split evenly
+    // between the shards, responses that don't fit into a shard are not cached.
+    size_t maxBytes_ = 64 * 1024 * 1024;
+    // How long a cached response stays valid.
+    absl::Duration ttl_ = absl::Seconds(10);
+    // The number of shards, each shard is protected by its own mutex.
+    size_t shards_ = 16;
+    // Maps the client call context to the identity of the caller (e.g. its credentials), the responses
+    // are shared only between the calls with the same scope. It can be left empty only if all the
+    // clients that use the cache make their calls on behalf of the same identity.
+    std::function<std::string(void *context)> scope_;
+};
+
+// A sharded, size-bounded LRU cache of the serialized responses keyed by the caller scope and
+// the serialized requests. Concurrent misses for the same request are collapsed into a single
+// remote call. Errors are never cached.
+class ResponseCache {
+public:
+    typedef std::shared_ptr<const std::string> Response;
+private:
+    // The approximate bookkeeping overhead of an entry, counted towards the size limit
+    static constexpr size_t EntryOverhead = 64;
+
+    struct Entry {
+        std::string key_;
+        Response response_;
+        absl::Time expires_;
+    };
+
+    // A remote call in progress, the callers that miss the same key wait for its result
+    struct Call {
+        bool done_ = false;
+        absl::StatusOr<Response> result_;
+    };
+
+    struct Shard {
+        std::mutex mutex_;
+        std::condition_variable done_;
+        // Entries in the LRU order, the most recently used first
+        std::list<Entry> lru_;
+        // The keys are views into the `Entry::key_` of the list nodes, they are stable
+        absl::flat_hash_map<std::string_view, std::list<Entry>::iterator> entries_;
+        absl::flat_hash_map<std::string, std::shared_ptr<Call>> calls_;
+        size_t bytes_ = 0;
+    };
+
+    ResponseCacheOptions options_;
+    size_t numShards_;
+    size_t shardBytes_;
+    std::unique_ptr<Shard[]> shards_;
+
+    static std::string MakeKey(std::string_view scope, std::string_view service, std::string_view method,
+        bool json, const std::span<const char> &request) {
+        std::string key;
+        key.reserve(scope.size() + service.size() + method.size() + request.size() + 16);
+        // The scope is length-prefixed, so it can't be confused with the service name
+        key.append(std::to_string(scope.size()));
+        key.push_back(':');
+        key.append(scope);
+        key.append(service);
+        key.push_back('/');
+        key.append(method);
+        key.push_back(json ? 'j' : 'p');
+        key.append(request.data(), request.size());
+        return key;
+    }
+
+    void Erase(Shard &shard, std::list<Entry>::iterator pos) {
+        shard.bytes_ -= pos->key_.size() + pos->response_->size() + EntryOverhead;
+        shard.entries_.erase(std::string_view(pos->key_));
+        shard.lru_.erase(pos);
+    }
+
+    void Insert(Shard &shard, const std::string &key, const Response &response) {
+        size_t size = key.size() + response->size() + EntryOverhead;
+        if (size > shardBytes_) {
+            return;
+        }
+        while (shard.bytes_ + size > shardBytes_) {
+            Erase(shard, std::prev(shard.lru_.end()));
+        }
+        shard.lru_.push_front(Entry{key, response, absl::Now() + options_.ttl_});
+        shard.entries_[std::string_view(shard.lru_.front().key_)] = shard.lru_.begin();
+        shard.bytes_ += size;
+    }
+
+public:
+    explicit ResponseCache(const ResponseCacheOptions &options = ResponseCacheOptions()) :
+        options_(options), numShards_(std::max<size_t>(options.shards_, 1)),
+        shardBytes_(options.maxBytes_ / numShards_), shards_(new Shard[numShards_]) {}
+
+    ResponseCache(const ResponseCache&) = delete; // non construction-copyable
+    ResponseCache& operator = (const ResponseCache&) = delete; // non copyable
+
+    static std::shared_ptr<ResponseCache> make(const ResponseCacheOptions &options = ResponseCacheOptions()) {
+        return std::make_shared<ResponseCache>(options);
+    }
+
+    // Get the cached response for the request or call `fetch` to get it. If another thread is already
+    // fetching the same request, wait for its result instead of making a new call.
+    // context - the client call context, it's mapped to the caller scope with `ResponseCacheOptions::scope_`
+    // service, method, json - identify the request along with the serialized request body
+    // fetch - makes the remote call and returns the serialized response
+    absl::StatusOr<Response> GetOrFetch(void *context, std::string_view service, std::string_view method,
+        bool json, const std::span<const char> &request,
+        const std::function<absl::StatusOr<std::string>()> &fetch) {
+
+        std::string scope = options_.scope_ ? options_.scope_(context) : std::string();
+        std::string key = MakeKey(scope, service, method, json, request);
+        Shard &shard = shards_[absl::Hash<std::string>()(key) % numShards_];
+
+        std::unique_lock<std::mutex> lock(shard.mutex_);
+        auto pos = shard.entries_.find(std::string_view(key));
+        if (pos != shard.entries_.end()) {
+            if (pos->second->expires_ > absl::Now()) {
+                shard.lru_.splice(shard.lru_.begin(), shard.lru_, pos->second);
+                return pos->second->response_;
+            }
+            Erase(shard, pos->second);
+        }
+
+        auto callPos = shard.calls_.find(key);
+        if (callPos != shard.calls_.end()) {
+            std::shared_ptr<Call> call = callPos->second;
+            shard.done_.wait(lock, [&call]() { return call->done_; });
+            return call->result_;
+        }
+
+        auto call = std::make_shared<Call>();
+        call->result_ = absl::AbortedError("The response fetch has failed");
+        shard.calls_[key] = call;
+        lock.unlock();
+
+        // Complete the call even if `fetch` throws, the waiters get the error then
+        auto complete = absl::MakeCleanup([&]() {
+            if (!lock.owns_lock()) {
+                lock.lock();
+            }
+            call->done_ = true;
+            shard.calls_.erase(key);
+            shard.done_.notify_all();
+        });
+
+        absl::StatusOr<std::string> res = fetch();
+
+        lock.lock();
+        if (res.ok()) {
+            auto response = std::make_shared<const std::string>(std::move(res.value()));
+            Insert(shard, key, response);
+            call->result_ = std::move(response);
+        } else {
+            call->result_ = res.status();
+        }
+        std::move(complete).Invoke();
+        return call->result_;
+    }
+};
+
+} // namespace trpc
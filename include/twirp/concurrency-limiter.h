@@ -0,0 +1,165 @@
+// This file contains the adaptive concurrency limiter for Twirp servers. Instead of a fixed bound, the limit
+// follows the measured handler latency: it grows while the latency stays close to its long-term average and
+// shrinks when the requests start queueing (a gradient limiter similar to Netflix's Gradient2, with an
+// AIMD-style backoff on the dropped requests).
+#pragma once
+
+#include <twirp/rpc-defs.h>
+#include <absl/time/clock.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+
+namespace trpc {
+
+// Settings for the ConcurrencyLimiter.
+struct ConcurrencyLimiterOptions {
+    double initialLimit_ = 20;
+    double minLimit_ = 4;
+    double maxLimit_ = 1000;
+    // How much the latency may grow over its long-term average before the limit starts to shrink
+    double rttTolerance_ = 1.5;
+    // How quickly the limit follows its estimate (0..1)
+    double smoothing_ = 0.2;
+    // The number of samples in the long-term latency average
+    double longWindow_ = 600;
+    // The number of samples in the short-term latency average
+    double shortWindow_ = 10;
+    // The multiplicative decrease applied when a request is dropped (deadline exceeded, unavailable
+    // or resource exhausted)
+    double backoffRatio_ = 0.9;
+    // The share of the limit available for the low and normal priority requests. The high priority
+    // requests can use the whole limit, so the low-priority requests are shed first as the load grows.
+    double lowShare_ = 0.5;
+    double normalShare_ = 0.8;
+};
+
+class ConcurrencyPermit;
+
+// The adaptive limit on the number of requests in flight. Admission is lock-free, the latency
+// samples update the estimate under a mutex.
+class ConcurrencyLimiter {
+    ConcurrencyLimiterOptions options_;
+    std::atomic<int64_t> inFlight_ = 0;
+    std::atomic<double> limit_;
+
+    // The estimator state
+    std::mutex mutex_;
+    double longRtt_ = 0;
+    double shortRtt_ = 0;
+
+    double Share(Priority priority) const {
+        switch (priority) {
+            case Priority::kLow: return options_.lowShare_;
+            case Priority::kNormal: return options_.normalShare_;
+            case Priority::kHigh: return 1.0;
+        }
+        return 1.0;
+    }
+
+public:
+    explicit ConcurrencyLimiter(const ConcurrencyLimiterOptions &options = ConcurrencyLimiterOptions()) :
+        options_(options), limit_(options.initialLimit_) {}
+
+    ConcurrencyLimiter(const ConcurrencyLimiter&) = delete; // non construction-copyable
+    ConcurrencyLimiter& operator = (const ConcurrencyLimiter&) = delete; // non copyable
+
+    static std::shared_ptr<ConcurrencyLimiter> make(
+        const ConcurrencyLimiterOptions &options = ConcurrencyLimiterOptions()) {
+        return std::make_shared<ConcurrencyLimiter>(options);
+    }
+
+    // Try to admit the request of the given priority. Returns `resource_exhausted` if the priority
+    // class is over its share of the limit.
+    inline absl::StatusOr<ConcurrencyPermit> Acquire(Priority priority);
+
+    // Finish the admitted request, normally called by `ConcurrencyPermit`.
+    // latency - the time the request has spent in the handler
+    // dropped - the request has failed because of the overload
+    void Release(absl::Duration latency, bool dropped) {
+        int64_t inFlight = inFlight_.fetch_sub(1);
+        double rtt = std::max(absl::ToDoubleMicroseconds(latency), 1.0);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (longRtt_ == 0) {
+            longRtt_ = rtt;
+            shortRtt_ = rtt;
+        }
+        longRtt_ += (rtt - longRtt_) / options_.longWindow_;
+        shortRtt_ += (rtt - shortRtt_) / options_.shortWindow_;
+
+        double limit = limit_.load();
+        double estimate;
+        if (dropped) {
+            estimate = limit * options_.backoffRatio_;
+        } else if (static_cast<double>(inFlight) * 2 < limit) {
+            // The server is not using its limit, the latency says nothing about the overload
+            return;
+        } else {
+            double gradient = std::clamp(options_.rttTolerance_ * longRtt_ / shortRtt_, 0.5, 1.0);
+            // Leave room for a small queue so that the limit can grow
+            estimate = limit * gradient + std::sqrt(limit);
+        }
+        limit = limit * (1 - options_.smoothing_) + estimate * options_.smoothing_;
+        limit_.store(std::clamp(limit, options_.minLimit_, options_.maxLimit_));
+
+        // Let the long-term average recover faster after a period of overload
+        if (longRtt_ > shortRtt_ * 2) {
+            longRtt_ *= 0.95;
+        }
+    }
+
+    // The current concurrency limit
+    double Limit() const {
+        return limit_.load();
+    }
+
+    int64_t InFlight() const {
+        return inFlight_.load();
+    }
+};
+
+// An admitted request, the limiter is updated with its latency when the permit is destroyed.
+class ConcurrencyPermit {
+    ConcurrencyLimiter *limiter_;
+    absl::Time start_;
+    bool dropped_ = false;
+public:
+    ConcurrencyPermit(ConcurrencyLimiter *limiter, absl::Time start) : limiter_(limiter), start_(start) {}
+
+    ConcurrencyPermit(ConcurrencyPermit &&other) noexcept :
+        limiter_(other.limiter_), start_(other.start_), dropped_(other.dropped_) {
+        other.limiter_ = nullptr;
+    }
+
+    ConcurrencyPermit(const ConcurrencyPermit&) = delete; // non construction-copyable
+    ConcurrencyPermit& operator = (const ConcurrencyPermit&) = delete; // non copyable
+
+    ~ConcurrencyPermit() {
+        if (limiter_) {
+            limiter_->Release(absl::Now() - start_, dropped_);
+        }
+    }
+
+    // Mark the request as failed because of the overload
+    void SetDropped() {
+        dropped_ = true;
+    }
+};
+
+absl::StatusOr<ConcurrencyPermit> ConcurrencyLimiter::Acquire(Priority priority) {
+    auto allowed = std::max<int64_t>(1, static_cast<int64_t>(limit_.load() * Share(priority)));
+    if (inFlight_.fetch_add(1) >= allowed) {
+        inFlight_.fetch_sub(1);
+        return absl::ResourceExhaustedError("The server is overloaded");
+    }
+    return ConcurrencyPermit(this, absl::Now());
+}
+
+// Check if the request has failed because the server (or its dependencies) are overloaded
+inline bool IsOverloadStatus(const absl::Status &status) {
+    return absl::IsDeadlineExceeded(status) || absl::IsUnavailable(status) || absl::IsResourceExhausted(status);
+}
+
+} // namespace trpc
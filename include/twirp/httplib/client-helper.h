@@ -6,7 +6,9 @@
 #include <httplib.h>
 #include <twirp/rpc-defs.h>
 #include <twirp/error-defs.h>
+#include <twirp/tracing.h>
 #include <json/json.h>
+#include <cstdio>
 
 namespace trpc {
 
@@ -100,6 +102,143 @@ public:
 class HttplibRequester : public trpc::Requester {
     httplib::Client client_;
     ClientMiddlewares middlewares_;
+    std::shared_ptr<Tracer> tracer_;
+    SpillOptions spill_;
+    bool markServerErrors_ = false;
+
+    absl::Status DecodeServerError(const httplib::Response &response) const {
+        absl::Status res = DecodeError(response);
+        if (markServerErrors_) {
+            MarkServerError(res);
+        }
+        return res;
+    }
+
+    // Run the middlewares and set up the trace, returns the trace ID (or 0) in `traceId`
+    absl::Status PrepareHeaders(gp::Arena *arena, void *context, const std::span<char> &data, bool json,
+        std::string_view service, std::string_view method, httplib::Headers *headers, uint64_t *traceId) {
+
+        for(const auto &m : middlewares_) {
+            // Will likely mutate the headers
+            auto st = m->Handle(arena, context, data, json, service, method, headers);
+            if (!st.ok()) {
+                return st;
+            }
+        }
+
+        // Propagate the trace of the current server request or sample a new one
+        ActiveTrace active = ActiveTrace::Current();
+        *traceId = active.traceId_ != 0 ? active.traceId_ : (tracer_ ? tracer_->Sample() : 0);
+        if (*traceId != 0) {
+            char buf[17];
+            snprintf(buf, sizeof(buf), "%llx", static_cast<unsigned long long>(*traceId));
+            headers->emplace(std::string(TraceIdHeader), buf);
+        }
+        return absl::OkStatus();
+    }
+
+    void RecordTrace(uint64_t traceId, int64_t start, std::string_view method) {
+        if (traceId != 0) {
+            Tracer *tracer = tracer_ ? tracer_.get() : ActiveTrace::Current().tracer_;
+            tracer->Record(traceId, TracePhase::kClient, start, absl::GetCurrentTimeNanos(), method);
+        }
+    }
+
+    static std::string MakeUrl(std::string_view service, std::string_view method) {
+        std::string url = std::string("/twirp/");
+        url += service;
+        url += "/";
+        url += method;
+        return url;
+    }
+
+    // Send the request to the given route path, the response is kept on the heap
+    absl::StatusOr<std::string> Post(gp::Arena *arena, void *context, const std::span<char> &data, bool json,
+        const char *path, std::string_view service, std::string_view method) {
+
+        httplib::Headers headers;
+        uint64_t traceId;
+        auto st = PrepareHeaders(arena, context, data, json, service, method, &headers, &traceId);
+        if (!st.ok()) {
+            return st;
+        }
+
+        int64_t start = absl::GetCurrentTimeNanos();
+        auto res = client_.Post(path, headers, data.data(), data.size(),
+            json ? "application/json" : "application/protobuf");
+        RecordTrace(traceId, start, method);
+        if (!res) {
+            // Return the error
+            return absl::UnavailableError(to_string(res.error()));
+        }
+
+        const httplib::Response &response = res.value();
+        if (response.status != 200) {
+            return DecodeServerError(response);
+        }
+
+        return response.body;
+    }
+
+    // Send the request to the given route path, the response is received directly into a memory-mapped
+    // buffer if it's larger than the spill threshold.
+    absl::StatusOr<MessageBody> PostSpilled(gp::Arena *arena, void *context, const std::span<char> &data,
+        bool json, const char *path, std::string_view service, std::string_view method) {
+
+        httplib::Request req;
+        req.method = "POST";
+        req.path = path;
+        uint64_t traceId;
+        auto st = PrepareHeaders(arena, context, data, json, service, method, &req.headers, &traceId);
+        if (!st.ok()) {
+            return st;
+        }
+        req.headers.emplace("Content-Type", json ? "application/json" : "application/protobuf");
+        // Stream the body straight from the (possibly memory-mapped) buffer instead of copying it
+        req.content_length_ = data.size();
+        req.content_provider_ = [&data](size_t offset, size_t length, httplib::DataSink &sink) {
+            return sink.write(data.data() + offset, std::min(length, data.size() - offset));
+        };
+
+        // The successful response goes into the builder, the error response is kept on the heap
+        MessageBodyBuilder builder(spill_);
+        absl::Status bodyStatus;
+        int status = 0;
+        std::string errorBody;
+        req.response_handler = [&](const httplib::Response &response) {
+            status = response.status;
+            if (status == 200 && response.has_header("Content-Length")) {
+                bodyStatus = builder.Reserve(
+                    std::strtoull(response.get_header_value("Content-Length").c_str(), nullptr, 10));
+            }
+            return bodyStatus.ok();
+        };
+        req.content_receiver = [&](const char *chunk, size_t len, uint64_t, uint64_t) {
+            if (status != 200) {
+                errorBody.append(chunk, len);
+                return true;
+            }
+            bodyStatus = builder.Append(chunk, len);
+            return bodyStatus.ok();
+        };
+
+        int64_t start = absl::GetCurrentTimeNanos();
+        auto res = client_.send(req);
+        RecordTrace(traceId, start, method);
+        if (!bodyStatus.ok()) {
+            return bodyStatus;
+        }
+        if (!res) {
+            return absl::UnavailableError(to_string(res.error()));
+        }
+
+        if (status != 200) {
+            httplib::Response response = res.value();
+            response.body = std::move(errorBody);
+            return DecodeServerError(response);
+        }
+        return builder.Finish();
+    }
 public:
     // Create the requester using the specified httplib client. This client needs to have the base URL for the
     // service and any other settings you with to use (e.g. custom SSL CA storage). The base URL needs to have
@@ -117,38 +256,61 @@ public:
     HttplibRequester(const HttplibRequester&) = delete; // non construction-copyable
     HttplibRequester& operator = (const HttplibRequester&) = delete; // non copyable
 
+    // Set the tracer for the sampled client-side request timings. The trace ID of the sampled requests
+    // (or of the server request that is being processed by the current thread) is passed to the server
+    // in the `X-Twirp-Trace-Id` header.
+    void SetTracer(std::shared_ptr<Tracer> tracer) {
+        tracer_ = std::move(tracer);
+    }
+
+    // Mark the errors returned by the server with `MarkServerError`, so that they can be told apart from
+    // the client-side failures (e.g. by `TwirpErrorCode` in the load generator). Off by default, the errors
+    // carry only the metadata sent by the server.
+    void SetMarkServerErrors(bool mark) {
+        markServerErrors_ = mark;
+    }
+
+    // Enable spilling of the large request and response bodies to memory-mapped temporary files. The
+    // generated clients serialize the large requests into them, and the responses are returned by
+    // `MakeRequestBody`.
+    void SetSpillOptions(const SpillOptions &spill) {
+        spill_ = spill;
+    }
+
+    SpillOptions GetSpillOptions() const override {
+        return spill_;
+    }
+
     // Implements the requester interface
     absl::StatusOr<std::string> MakeRequest(gp::Arena *arena, void *context, const std::span<char> &data,
         bool json, std::string_view service, std::string_view method) override {
+        return Post(arena, context, data, json, MakeUrl(service, method).c_str(), service, method);
+    }
 
-        httplib::Headers headers;
-
-        std::string url = std::string("/twirp/");
-        url += service;
-        url += "/";
-        url += method;
+    // Implements the requester interface, the response is received directly into a memory-mapped
+    // buffer if it's larger than the spill threshold.
+    absl::StatusOr<MessageBody> MakeRequestBody(gp::Arena *arena, void *context, const std::span<char> &data,
+        bool json, std::string_view service, std::string_view method) override {
 
-        for(const auto &m : middlewares_) {
-            // Will likely mutate the headers
-            auto st = m->Handle(arena, context, data, json, service, method, &headers);
-            if (!st.ok()) {
-                return st;
-            }
+        if (spill_.threshold_ == 0) {
+            return Requester::MakeRequestBody(arena, context, data, json, service, method);
         }
+        return PostSpilled(arena, context, data, json, MakeUrl(service, method).c_str(), service, method);
+    }
 
-        auto res = client_.Post(url.c_str(), headers, data.data(), data.size(),
-            json ? "application/json" : "application/protobuf");
-        if (!res) {
-            // Return the error
-            return absl::UnavailableError(to_string(res.error()));
-        }
+    // Implements the `RequestTransport` concept for the templated clients. It's not virtual, and the route
+    // path is precomputed by the generated code.
+    absl::StatusOr<MessageBody> MakeRoutedRequest(gp::Arena *arena, void *context, const std::span<char> &data,
+        bool json, const char *path, std::string_view service, std::string_view method) {
 
-        const httplib::Response &response = res.value();
-        if (response.status != 200) {
-            return DecodeError(response);
+        if (spill_.threshold_ != 0) {
+            return PostSpilled(arena, context, data, json, path, service, method);
         }
-
-        return response.body;
+        auto res = Post(arena, context, data, json, path, service, method);
+        if (!res.ok()) {
+            return res.status();
+        }
+        return MessageBody(std::move(res.value()));
     }
 };
 
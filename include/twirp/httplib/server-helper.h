@@ -5,8 +5,18 @@
 
 #include <twirp/rpc-defs.h>
 #include <twirp/error-defs.h>
+#include <twirp/tracing.h>
+#include <twirp/concurrency-limiter.h>
+#include <twirp/rate-limiter.h>
+#include <twirp/capture.h>
 #include <httplib.h>
 #include <json/json.h>
+#include <absl/container/flat_hash_map.h>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <optional>
+#include <thread>
 
 namespace trpc {
 
@@ -15,7 +25,8 @@ constexpr auto MalformedError = std::make_pair("malformed",	400);
 // An error returned if the request can't be matched with a service method
 constexpr auto BadRouteError = std::make_pair("bad_route", 404);
 
-// Pure virtual class for middleware implementations, typically used for things like authentication or logging
+// Base class for middleware implementations, typically used for things like authentication or logging.
+// Override `Handle`, or `HandleWithBody` if the middleware needs to inspect the request body.
 class ServerMiddleware {
 public:
     virtual ~ServerMiddleware() = default;
@@ -23,16 +34,71 @@ public:
     // arena - the arena for the request, it's guaranteed to survive until the end of the request.
     // ctx - the request context that can be used to pass the data from this handler to the service method
     // json - the json flag
-    // request - the raw HTTP request
+    // request - the raw HTTP request. Note that the body is streamed through the content reader (so that
+    // the size limits are enforced before it's buffered), `request.body` is always empty. Use
+    // `HandleWithBody` to get the body.
     // response - the raw HTTP response (can be used to supply additional headers)
     // returns - any status but `OkStatus` will stop further request processing and will be returned
     // to the client.
     virtual absl::Status Handle(gp::Arena *arena, trpc::RequestContext *ctx, bool json,
-        const httplib::Request &request, httplib::Response &response) = 0;
+        const httplib::Request &request, httplib::Response &response) {
+        return absl::OkStatus();
+    }
+
+    // This method is called by the server handler, the default implementation calls `Handle`.
+    // body - the request body, valid until the end of the request
+    virtual absl::Status HandleWithBody(gp::Arena *arena, trpc::RequestContext *ctx, bool json,
+        const httplib::Request &request, std::span<const char> body, httplib::Response &response) {
+        return Handle(arena, ctx, json, request, response);
+    }
 };
 
 typedef std::vector<std::shared_ptr<ServerMiddleware>> ServerMiddlewares;
 
+// The error metadata key with the number of milliseconds to wait before retrying a rate-limited request
+constexpr absl::string_view RetryAfterKey = "retry_after_ms";
+
+// Rate-limiting middleware, the requests are limited per value of the `Key` stored in the request context
+// (e.g. per user). Place it after the middleware that sets the key. Limited requests are rejected with
+// `resource_exhausted`, the time to wait is returned in the `retry_after_ms` metadata and in the
+// `Retry-After` header.
+template<class Key> requires RequestContextKey<Key> class RateLimitMiddleware : public ServerMiddleware {
+public:
+    // Get the rate-limiting key from the context value, requests with an empty key are not limited.
+    // The result must point into the value.
+    typedef std::function<std::string_view(const typename Key::ValueType&)> KeyExtractor;
+private:
+    std::shared_ptr<RateLimiter> limiter_;
+    KeyExtractor extractor_;
+public:
+    RateLimitMiddleware(std::shared_ptr<RateLimiter> limiter, KeyExtractor extractor) :
+        limiter_(std::move(limiter)), extractor_(std::move(extractor)) {}
+
+    static std::shared_ptr<ServerMiddleware> make(const RateLimiterOptions &options, KeyExtractor extractor) {
+        return std::make_shared<RateLimitMiddleware<Key>>(RateLimiter::make(options), std::move(extractor));
+    }
+
+    absl::Status Handle(gp::Arena *arena, trpc::RequestContext *ctx, bool json,
+        const httplib::Request &request, httplib::Response &response) override {
+
+        std::string_view key = extractor_(ctx->GetOrDef<Key>());
+        if (key.empty()) {
+            return absl::OkStatus();
+        }
+
+        absl::Duration retryAfter;
+        if (limiter_->TryAcquire(key, &retryAfter)) {
+            return absl::OkStatus();
+        }
+
+        auto ms = absl::ToInt64Milliseconds(absl::Ceil(retryAfter, absl::Milliseconds(1)));
+        response.set_header("Retry-After", std::to_string((ms + 999) / 1000));
+        auto res = absl::ResourceExhaustedError("Rate limit exceeded");
+        res.SetPayload(RetryAfterKey, absl::Cord(std::to_string(ms)));
+        return res;
+    }
+};
+
 // Send a Twirp error, used internally in the server handler.
 // See https://twitchtv.github.io/twirp/docs/spec_v7.html for error specifications.
 // err - a pair of error_code and the HTTP status
@@ -83,17 +149,280 @@ inline void SendError(const absl::Status &status, httplib::Response &resp) {
     resp.set_content(jsonError, "application/json");
 }
 
+// The default limit on the request body size. It can be raised up to `INT_MAX - 1`, the limit
+// of `DeserializeMessage`, for the methods that take larger messages.
+constexpr size_t DefaultMaxRequestSize = 64 * 1024 * 1024;
+
+// Options for the handlers installed by `RegisterTwirpHandlers`.
+struct ServerOptions {
+    // The maximum size of the request body in bytes. Requests with a larger `Content-Length` are
+    // rejected with an `out_of_range` error before any of their body is read.
+    size_t maxRequestSize_ = DefaultMaxRequestSize;
+    // Per-method overrides for `maxRequestSize_`, keyed by the method name (e.g. "MakeHat").
+    absl::flat_hash_map<std::string, size_t> methodMaxRequestSize_;
+    // Optional tracer for the sampled per-request phase timings.
+    std::shared_ptr<Tracer> tracer_;
+    // Trace the requests that carry the trace ID header whenever the tracer is enabled, regardless of
+    // the sampling. Enable it only if the clients are trusted, otherwise any caller can force tracing.
+    bool trustTraceIds_ = false;
+    // Optional adaptive limit on the concurrent requests, share it between all the services registered
+    // in the same server. The requests over the limit of their priority class are rejected with
+    // `resource_exhausted`. The requests are admitted in the server worker threads, so install
+    // `LimiterThreadPool` in the server (see `InstallLimiterThreadPool`) to run more requests than the
+    // limiter allows, otherwise they would queue in the pool unseen by the limiter.
+    std::shared_ptr<ConcurrencyLimiter> limiter_;
+    // Per-method priority overrides, keyed by the method name. The default is taken from the
+    // `(twirp.cpp.priority)` method option.
+    absl::flat_hash_map<std::string, Priority> methodPriority_;
+    // Spilling of the large request and response bodies to memory-mapped temporary files, disabled
+    // by default. The binary requests are parsed directly from the mapping and the binary responses
+    // are serialized into it.
+    SpillOptions spill_;
+    // Optional log for the sampled requests, they can be replayed later (see replay.h). The requests
+    // are captured after the middlewares, together with the keys (and the string values) they have
+    // put into the request context. The requests rejected before that are not captured.
+    std::shared_ptr<CaptureLog> capture_;
+
+    // Get the request size limit for the given method.
+    size_t GetMaxRequestSize(const std::string &method) const {
+        auto pos = methodMaxRequestSize_.find(method);
+        if (pos == methodMaxRequestSize_.end()) {
+            return maxRequestSize_;
+        }
+        return pos->second;
+    }
+
+    // Get the priority class for the given method of the service host.
+    Priority GetPriority(const ServiceHostBase *host, const std::string &method) const {
+        auto pos = methodPriority_.find(method);
+        if (pos == methodPriority_.end()) {
+            return host->GetMethodPriority(method);
+        }
+        return pos->second;
+    }
+};
+
+// Read the request body using the streaming content reader, used internally in the server handler.
+// The body buffer grows with the received data (moving to a memory-mapped file once it's larger than
+// the spill threshold), and requests that declare (or send, for chunked requests) more than `maxSize`
+// bytes are rejected without buffering their body.
+inline absl::Status ReadRequestBody(const httplib::Request &req, const httplib::ContentReader &reader,
+    size_t maxSize, const SpillOptions &spill, MessageBody *body) {
+
+    MessageBodyBuilder builder(spill);
+    if (req.has_header("Content-Length")) {
+        auto declared = std::strtoull(req.get_header_value("Content-Length").c_str(), nullptr, 10);
+        if (declared > maxSize) {
+            return absl::OutOfRangeError("Request body is too large");
+        }
+        auto st = builder.Reserve(declared);
+        if (!st.ok()) {
+            return st;
+        }
+    }
+
+    bool tooLarge = false;
+    absl::Status appendStatus;
+    bool ok = reader([&](const char *data, size_t len) {
+        if (builder.size() + len > maxSize) {
+            tooLarge = true;
+            return false;
+        }
+        appendStatus = builder.Append(data, len);
+        return appendStatus.ok();
+    });
+    if (tooLarge) {
+        return absl::OutOfRangeError("Request body is too large");
+    }
+    if (!appendStatus.ok()) {
+        return appendStatus;
+    }
+    if (!ok) {
+        auto res = absl::Status(absl::StatusCode::kInvalidArgument, "Failed to read the request body");
+        res.SetPayload(TwirpStatusKey, absl::Cord("malformed"));
+        return res;
+    }
+    *body = builder.Finish();
+    return absl::OkStatus();
+}
+
+// Decide if the request should be traced, returns the trace ID or 0. Used internally in the server handler.
+// trustTraceIds - honour the incoming trace ID header, see `ServerOptions::trustTraceIds_`
+inline uint64_t StartServerTrace(Tracer *tracer, bool trustTraceIds, const httplib::Request &req) {
+    if (!tracer || !tracer->Enabled()) {
+        return 0;
+    }
+    if (trustTraceIds && req.has_header(TraceIdHeader.data())) {
+        uint64_t traceId = std::strtoull(req.get_header_value(TraceIdHeader.data()).c_str(), nullptr, 16);
+        if (traceId != 0) {
+            return traceId;
+        }
+    }
+    return tracer->Sample();
+}
+
+// Send the response body that is memory-mapped or belongs to a traced request, used internally in the
+// server handler. The body is streamed from its buffer, and for the traced requests the write into
+// the socket is recorded as a separate phase.
+inline void SetStreamedContent(Tracer *tracer, uint64_t traceId, MessageBody &&data, const char *contentType,
+    httplib::Response &res) {
+
+    auto body = std::make_shared<MessageBody>(std::move(data));
+    auto writeStart = std::make_shared<int64_t>(0);
+    res.set_content_provider(body->size(), contentType,
+        [body, writeStart](size_t offset, size_t length, httplib::DataSink &sink) {
+            if (*writeStart == 0) {
+                *writeStart = absl::GetCurrentTimeNanos();
+            }
+            return sink.write(body->Span().data() + offset, length);
+        },
+        [tracer, traceId, writeStart](auto&&...) {
+            if (traceId != 0 && *writeStart != 0) {
+                tracer->Record(traceId, TracePhase::kWrite, *writeStart, absl::GetCurrentTimeNanos());
+            }
+        });
+}
+
+// Settings for the LimiterThreadPool.
+struct LimiterThreadPoolOptions {
+    // The maximum number of the worker threads. Set it above the limiter's `maxLimit_` plus the number
+    // of the idle keep-alive connections, each connection occupies a worker while it's open.
+    size_t maxThreads_ = 128;
+    // The workers that have been idle for this long exit
+    absl::Duration idleTimeout_ = absl::Seconds(30);
+    // The keep-alive timeout for the server, short enough for the idle connections to release
+    // their workers quickly
+    absl::Duration keepAliveTimeout_ = absl::Seconds(1);
+};
+
+// The worker pool for the servers with a concurrency limiter. It starts the threads on demand, up to
+// `maxThreads_`, so the requests over the limit reach the limiter and are rejected right away instead
+// of waiting for a free worker. The threads exit after being idle for `idleTimeout_`.
+class LimiterThreadPool : public httplib::TaskQueue {
+    LimiterThreadPoolOptions options_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::function<void()>> tasks_;
+    std::list<std::thread> threads_;
+    // The threads that have exited after being idle, they are joined outside of the lock
+    std::vector<std::thread> exited_;
+    size_t idle_ = 0;
+    bool shutdown_ = false;
+
+    void Work(std::list<std::thread>::iterator self) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            idle_++;
+            bool ready = ready_.wait_for(lock, absl::ToChronoNanoseconds(options_.idleTimeout_),
+                [this]() { return shutdown_ || !tasks_.empty(); });
+            idle_--;
+            if (!ready) {
+                exited_.push_back(std::move(*self));
+                threads_.erase(self);
+                return;
+            }
+            if (tasks_.empty()) {
+                return;
+            }
+            auto task = std::move(tasks_.front());
+            tasks_.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+public:
+    explicit LimiterThreadPool(const LimiterThreadPoolOptions &options = LimiterThreadPoolOptions()) :
+        options_(options) {
+        options_.maxThreads_ = std::max<size_t>(options_.maxThreads_, 1);
+    }
+
+    ~LimiterThreadPool() override {
+        shutdown();
+    }
+
+    void enqueue(std::function<void()> fn) override {
+        std::vector<std::thread> exited;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(fn));
+            if (idle_ < tasks_.size() && threads_.size() < options_.maxThreads_) {
+                // The thread can't run before the lock is released, so its iterator is set by then
+                auto self = threads_.emplace(threads_.end());
+                *self = std::thread([this, self]() { Work(self); });
+            }
+            exited.swap(exited_);
+        }
+        ready_.notify_one();
+        for (auto &t : exited) {
+            t.join();
+        }
+    }
+
+    // The number of the worker threads that are running
+    size_t Threads() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return threads_.size();
+    }
+
+    void shutdown() override {
+        std::list<std::thread> threads;
+        std::vector<std::thread> exited;
+        {
+            // The threads don't touch `threads_` once the shutdown has started
+            std::lock_guard<std::mutex> lock(mutex_);
+            shutdown_ = true;
+            threads.swap(threads_);
+            exited.swap(exited_);
+        }
+        ready_.notify_all();
+        for (auto &t : threads) {
+            if (t.joinable()) {
+                t.join();
+            }
+        }
+        for (auto &t : exited) {
+            t.join();
+        }
+    }
+};
+
+// Replace the server's task queue with `LimiterThreadPool` and shorten its keep-alive timeout. Call it
+// once before starting the server that has a concurrency limiter (see `ServerOptions::limiter_`).
+inline void InstallLimiterThreadPool(httplib::Server *srv,
+    const LimiterThreadPoolOptions &options = LimiterThreadPoolOptions()) {
+    srv->set_keep_alive_timeout(std::max<time_t>(absl::ToInt64Seconds(options.keepAliveTimeout_), 1));
+    srv->new_task_queue = [options]() { return new LimiterThreadPool(options); };
+}
+
 // Register the Twirp handlers for the given handler in the HTTP server provided.
+// options - request size limits and other settings for the registered handlers
 inline void RegisterTwirpHandlers(trpc::ServiceHostBase *handler, httplib::Server *srv,
-    const ServerMiddlewares &middleware) {
+    const ServerMiddlewares &middleware, const ServerOptions &options = ServerOptions()) {
 
     for (const auto &meth : handler->GetMethods()) {
         std::string pattern = "/twirp/";
         pattern += handler->GetServiceName();
         pattern += "/";
         pattern += meth;
-        srv->Post(pattern, [handler, meth, middleware](
-            const httplib::Request &req, httplib::Response &res) {
+        size_t maxSize = options.GetMaxRequestSize(std::string(meth));
+        Priority priority = options.GetPriority(handler, std::string(meth));
+        srv->Post(pattern, [handler, meth, middleware, maxSize, priority, tracer = options.tracer_,
+            trustTraceIds = options.trustTraceIds_, limiter = options.limiter_, spill = options.spill_, capture = options.capture_](
+            const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &reader) {
+
+            bool captured = capture && capture->Sample();
+            absl::Time received = captured ? absl::Now() : absl::InfinitePast();
+
+            // The tracing costs only this check if the request is not sampled
+            uint64_t traceId = StartServerTrace(tracer.get(), trustTraceIds, req);
+            std::optional<ActiveTraceScope> activeTrace;
+            if (traceId != 0) {
+                activeTrace.emplace(tracer.get(), traceId);
+            }
+            TraceScope requestPhase(TracePhase::kRequest, meth);
+            TraceScope phase(TracePhase::kContentType);
 
             auto ct = req.get_header_value("content-type");
             bool json;
@@ -102,34 +431,70 @@ inline void RegisterTwirpHandlers(trpc::ServiceHostBase *handler, httplib::Serve
             } else if (ct == "application/protobuf") {
                 json = false;
             } else {
+                // The body is not going to be read, so the connection can't be reused
+                res.set_header("Connection", "close");
                 return SendError(MalformedError, "Unknown message encoding", res);
             }
 
+            phase.Next(TracePhase::kReadBody);
+            MessageBody body;
+            auto readStatus = ReadRequestBody(req, reader, maxSize, spill, &body);
+            if (!readStatus.ok()) {
+                res.set_header("Connection", "close");
+                return SendError(readStatus, res);
+            }
+
+            // Shed the excess load before doing any work for the request
+            std::optional<ConcurrencyPermit> permit;
+            if (limiter) {
+                auto acquired = limiter->Acquire(priority);
+                if (!acquired.ok()) {
+                    return SendError(acquired.status(), res);
+                }
+                permit.emplace(std::move(acquired.value()));
+            }
+
+            phase.Next(TracePhase::kMiddleware);
             auto arena = std::make_unique<gp::Arena>();
             trpc::RequestContext ctx;
 
             // Run middlewares
             for (auto &m : middleware) {
-                auto status = m->Handle(arena.get(), &ctx, json, req, res);
+                auto status = m->HandleWithBody(arena.get(), &ctx, json, req, body.Span(), res);
                 if (!status.ok()) {
                     return SendError(status, res);
                 }
             }
+            if (captured) {
+                capture->Append(received, handler->GetServiceName(), meth, json, ctx, body.Span());
+            }
+            // The generated Invoke records its own phases
+            phase.End();
 
-            auto methodResult = handler->Invoke(arena.get(), meth,
-                std::span(req.body.c_str(), req.body.size()), json, &ctx);
+            auto methodResult = handler->Invoke(arena.get(), meth, body.Span(), json, &ctx);
             if (!methodResult.ok()) {
+                if (permit && IsOverloadStatus(methodResult.status())) {
+                    permit->SetDropped();
+                }
                 return SendError(methodResult.status(), res);
             }
 
-            //TODO: use zero-copy to avoid two separate copies here.
-            absl::StatusOr<std::string> data = trpc::SerializeMessage(methodResult.value().get(), json);
+            phase.Next(TracePhase::kEncode);
+            absl::StatusOr<MessageBody> data = trpc::SerializeMessageBody(methodResult.value().get(), json, spill);
             if (!data.ok()) {
                 return SendError(data.status(), res);
             }
+            // The response is written after the handler returns, it's not a part of the measured latency
+            permit.reset();
 
             res.status = 200;
-            res.set_content(data.value(), json ? "application/json" : "application/protobuf");
+            const char *contentType = json ? "application/json" : "application/protobuf";
+            if (traceId != 0 || data.value().IsMapped()) {
+                SetStreamedContent(tracer.get(), traceId, std::move(data.value()), contentType, res);
+            } else {
+                //TODO: use zero-copy to avoid two separate copies here.
+                res.set_content(data.value().Heap(), contentType);
+            }
         });
 
         std::string anyPattern = "/twirp/";
@@ -0,0 +1,104 @@
+// This file contains a compact HdrHistogram-style latency histogram used by the load and replay tools.
+#pragma once
+
+#include <absl/time/time.h>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+namespace trpc {
+
+// A log-linear histogram of latencies with the microsecond resolution and ~1.5% relative precision,
+// similar to HdrHistogram with 2 significant digits. Values below 128us are recorded exactly, larger
+// values are grouped into 64 sub-buckets per power of two. Not thread-safe: record into a
+// histogram per thread and `Merge` them afterwards.
+class LatencyHistogram {
+    static constexpr int SubBucketBits = 7;
+    static constexpr uint64_t SubBucketCount = 1 << SubBucketBits;
+    static constexpr uint64_t SubBucketHalf = SubBucketCount / 2;
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    uint64_t max_ = 0;
+    uint64_t sum_ = 0;
+
+    static size_t IndexOf(uint64_t value) {
+        if (value < SubBucketCount) {
+            return value;
+        }
+        int shift = std::bit_width(value) - SubBucketBits;
+        return SubBucketCount + (shift - 1) * SubBucketHalf + ((value >> shift) - SubBucketHalf);
+    }
+
+    // The highest value that is recorded into the bucket with the given index
+    static uint64_t HighestValueAt(size_t index) {
+        if (index < SubBucketCount) {
+            return index;
+        }
+        uint64_t shift = (index - SubBucketCount) / SubBucketHalf + 1;
+        uint64_t sub = (index - SubBucketCount) % SubBucketHalf + SubBucketHalf;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    // Record a single latency value
+    void Record(absl::Duration latency) {
+        int64_t us = absl::ToInt64Microseconds(latency);
+        uint64_t value = us > 0 ? static_cast<uint64_t>(us) : 0;
+        size_t index = IndexOf(value);
+        if (index >= counts_.size()) {
+            counts_.resize(index + 1);
+        }
+        counts_[index]++;
+        total_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
+
+    // Add all the values from the other histogram
+    void Merge(const LatencyHistogram &other) {
+        if (other.counts_.size() > counts_.size()) {
+            counts_.resize(other.counts_.size());
+        }
+        for (size_t i = 0; i < other.counts_.size(); i++) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t Count() const {
+        return total_;
+    }
+
+    absl::Duration Max() const {
+        return absl::Microseconds(max_);
+    }
+
+    absl::Duration Mean() const {
+        return total_ == 0 ? absl::ZeroDuration() : absl::Microseconds(sum_ / total_);
+    }
+
+    // Get the value at the given percentile (0..100). The result is the highest value that is
+    // equivalent (within the histogram precision) to the actual value.
+    absl::Duration Percentile(double percentile) const {
+        if (total_ == 0) {
+            return absl::ZeroDuration();
+        }
+        auto target = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(total_) + 0.5);
+        target = std::clamp<uint64_t>(target, 1, total_);
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            seen += counts_[i];
+            if (seen >= target) {
+                return absl::Microseconds(std::min(HighestValueAt(i), max_));
+            }
+        }
+        return absl::Microseconds(max_);
+    }
+};
+
+} // namespace trpc
@@ -0,0 +1,199 @@
+// This file contains the load generator infrastructure for Twirp services, it drives the generated
+// clients and reports the throughput and latency percentiles broken down by the Twirp error code.
+// See https://github.com/Cyberax/twirp-cpp/blob/development/example/cpp/tw-load.cpp for the usage example.
+#pragma once
+
+#include <twirp/rpc-defs.h>
+#include <twirp/error-defs.h>
+#include <twirp/latency-histogram.h>
+#include <google/protobuf/text_format.h>
+#include <absl/time/clock.h>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <ostream>
+#include <thread>
+
+namespace trpc {
+
+// Encoding of the request corpus files
+enum class CorpusFormat {
+    // One Protobuf JSON request per line
+    kJson,
+    // Protobuf text format requests, separated by lines containing only `---`
+    kText,
+};
+
+// Load the request corpus for the method with the request type `T`.
+template<class T> absl::StatusOr<std::vector<T>> LoadCorpus(const std::string &path, CorpusFormat format) {
+    std::ifstream in(path);
+    if (!in) {
+        return absl::NotFoundError("Can't open the corpus file: " + path);
+    }
+
+    std::vector<std::string> records;
+    std::string line, current;
+    while (std::getline(in, line)) {
+        if (format == CorpusFormat::kJson) {
+            if (!line.empty()) {
+                records.push_back(line);
+            }
+        } else if (line == "---") {
+            records.push_back(std::move(current));
+            current.clear();
+        } else {
+            current += line;
+            current += "\n";
+        }
+    }
+    if (format == CorpusFormat::kText && !current.empty()) {
+        records.push_back(std::move(current));
+    }
+
+    std::vector<T> res(records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        bool ok;
+        if (format == CorpusFormat::kJson) {
+            ok = gp::util::JsonStringToMessage(records[i], &res[i]).ok();
+        } else {
+            ok = gp::TextFormat::ParseFromString(records[i], &res[i]);
+        }
+        if (!ok) {
+            return absl::InvalidArgumentError("Can't parse the corpus record #" + std::to_string(i));
+        }
+    }
+    if (res.empty()) {
+        return absl::InvalidArgumentError("The corpus is empty");
+    }
+    return res;
+}
+
+// Settings for the load generator
+struct LoadOptions {
+    // The number of concurrent workers, each worker has its own client
+    size_t concurrency_ = 1;
+    // The target request rate (per second) for the open-loop mode. In this mode the requests are
+    // scheduled at fixed intervals regardless of how fast the server responds, and the latency is
+    // measured from the scheduled start time (so the queueing delay is not omitted). Zero selects
+    // the closed-loop mode where each worker sends the next request as soon as it gets a response.
+    double rate_ = 0;
+    // The test duration
+    absl::Duration duration_ = absl::Seconds(10);
+};
+
+// The results of a load run.
+struct LoadReport {
+    absl::Duration elapsed_;
+    // Latencies for each outcome, keyed by the Twirp error code ("ok" for successful requests,
+    // see `TwirpErrorCode`)
+    std::map<std::string, LatencyHistogram> byCode_;
+
+    uint64_t Total() const {
+        uint64_t res = 0;
+        for (const auto &[code, hist] : byCode_) {
+            res += hist.Count();
+        }
+        return res;
+    }
+
+    // Print the human-readable report
+    void Print(std::ostream &out) const {
+        double seconds = absl::ToDoubleSeconds(elapsed_);
+        out << "Requests: " << Total() << " in " << elapsed_ << ", "
+            << (seconds > 0 ? static_cast<double>(Total()) / seconds : 0) << " req/s\n";
+
+        LatencyHistogram all;
+        for (const auto &[code, hist] : byCode_) {
+            all.Merge(hist);
+        }
+        PrintLine(out, "all", all);
+        for (const auto &[code, hist] : byCode_) {
+            PrintLine(out, code, hist);
+        }
+    }
+
+    static void PrintLine(std::ostream &out, const std::string &code, const LatencyHistogram &hist) {
+        out << "  " << code << ": count=" << hist.Count()
+            << " mean=" << hist.Mean()
+            << " p50=" << hist.Percentile(50)
+            << " p90=" << hist.Percentile(90)
+            << " p99=" << hist.Percentile(99)
+            << " p99.9=" << hist.Percentile(99.9)
+            << " max=" << hist.Max() << "\n";
+    }
+};
+
+// The prefix of the outcome labels for the calls that failed on the client side
+static constexpr std::string_view ClientErrorPrefix = "client:";
+
+// Get the Twirp error code for the status ("ok" for successful calls). The errors that didn't come
+// from the server, e.g. the connection failures, are labelled with the `ClientErrorPrefix` and the
+// corresponding code (e.g. "client:unavailable"). The server errors have to be marked with
+// `MarkServerError`, see `HttplibRequester::SetMarkServerErrors`.
+inline std::string TwirpErrorCode(const absl::Status &status) {
+    if (status.ok()) {
+        return "ok";
+    }
+    auto code = status.GetPayload(TwirpStatusKey);
+    if (code.has_value()) {
+        return std::string(code.value());
+    }
+    return std::string(ClientErrorPrefix) + std::string(StatusToErrorCode(status.code()).first);
+}
+
+// A single request invocation. The argument is the sequential number of the request, it can
+// be used to pick the request from the corpus.
+typedef std::function<absl::Status(size_t)> LoadCall;
+
+// Run the load test. `makeCall` is invoked once per worker (from the worker's thread) to create
+// the worker's call function, so that each worker can use its own client and connection.
+inline LoadReport RunLoad(const LoadOptions &options, const std::function<LoadCall(size_t)> &makeCall) {
+    std::atomic<size_t> next = 0;
+    std::vector<std::map<std::string, LatencyHistogram>> results(options.concurrency_);
+
+    absl::Time start = absl::Now() + absl::Milliseconds(100); // Give the workers a head start
+    absl::Time deadline = start + options.duration_;
+
+    auto worker = [&](size_t id) {
+        LoadCall call = makeCall(id);
+        while (true) {
+            size_t seq = next++;
+            absl::Time scheduled;
+            if (options.rate_ > 0) {
+                scheduled = start + absl::Seconds(static_cast<double>(seq) / options.rate_);
+                if (scheduled >= deadline) {
+                    break;
+                }
+                absl::SleepFor(scheduled - absl::Now());
+            } else {
+                absl::SleepFor(start - absl::Now());
+                scheduled = absl::Now();
+                if (scheduled >= deadline) {
+                    break;
+                }
+            }
+
+            absl::Status status = call(seq);
+            results[id][TwirpErrorCode(status)].Record(absl::Now() - scheduled);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < options.concurrency_; i++) {
+        threads.emplace_back(worker, i);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    LoadReport report;
+    report.elapsed_ = std::min(absl::Now(), deadline) - start;
+    for (const auto &workerResult : results) {
+        for (const auto &[code, hist] : workerResult) {
+            report.byCode_[code].Merge(hist);
+        }
+    }
+    return report;
+}
+
+} // namespace trpc
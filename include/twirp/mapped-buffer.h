@@ -0,0 +1,244 @@
+// This file contains the message bodies that can be spilled to memory-mapped temporary files, they are
+// used to keep the heap usage bounded for very large requests and responses.
+#pragma once
+
+#include <absl/status/statusor.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace trpc {
+
+// A buffer backed by an unlinked temporary file that is mapped into memory. Its pages are managed
+// by the kernel page cache instead of the heap, and the file disappears when the buffer is destroyed.
+// Not available on Windows, the spill options are ignored there.
+class MappedBuffer {
+    int fd_;
+    char *data_ = nullptr;
+    size_t capacity_ = 0;
+
+    explicit MappedBuffer(int fd) : fd_(fd) {}
+
+public:
+    ~MappedBuffer() {
+#ifndef _WIN32
+        if (data_) {
+            munmap(data_, capacity_);
+        }
+        close(fd_);
+#endif
+    }
+
+    MappedBuffer(const MappedBuffer&) = delete; // non construction-copyable
+    MappedBuffer& operator = (const MappedBuffer&) = delete; // non copyable
+
+    // Create the buffer of the given size.
+    // dir - the directory for the temporary file, the system temporary directory if empty
+    static absl::StatusOr<std::shared_ptr<MappedBuffer>> Create(size_t size, const std::string &dir = "") {
+#ifdef _WIN32
+        return absl::UnimplementedError("Memory-mapped buffers are not supported");
+#else
+        std::string path = dir.empty() ? std::filesystem::temp_directory_path().string() : dir;
+        int fd = -1;
+#ifdef O_TMPFILE
+        fd = open(path.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+        if (fd < 0) {
+            // Not supported by the kernel or the file system, create and unlink a regular file
+            std::string tmpl = path + "/twirp-body-XXXXXX";
+            fd = mkstemp(tmpl.data());
+            if (fd >= 0) {
+                unlink(tmpl.c_str());
+            }
+        }
+        if (fd < 0) {
+            return absl::UnavailableError("Can't create a temporary file in " + path + ": " + strerror(errno));
+        }
+
+        std::shared_ptr<MappedBuffer> res(new MappedBuffer(fd));
+        auto st = res->Resize(size);
+        if (!st.ok()) {
+            return st;
+        }
+        return res;
+#endif
+    }
+
+    // Change the size of the buffer, the contents are preserved up to the new size. The data pointer
+    // is invalidated.
+    absl::Status Resize(size_t size) {
+#ifdef _WIN32
+        return absl::UnimplementedError("Memory-mapped buffers are not supported");
+#else
+        // Empty mappings are not allowed
+        size = std::max<size_t>(size, 1);
+        if (ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+            return absl::ResourceExhaustedError(std::string("Can't resize the temporary file: ") + strerror(errno));
+        }
+        if (data_) {
+            munmap(data_, capacity_);
+            data_ = nullptr;
+        }
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED) {
+            return absl::ResourceExhaustedError(std::string("Can't map the temporary file: ") + strerror(errno));
+        }
+        data_ = static_cast<char*>(addr);
+        capacity_ = size;
+        return absl::OkStatus();
+#endif
+    }
+
+    char *data() const {
+        return data_;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+};
+
+// A serialized message, stored either on the heap or in a memory-mapped temporary file.
+class MessageBody {
+    std::string heap_;
+    std::shared_ptr<MappedBuffer> mapped_;
+    size_t size_ = 0;
+public:
+    MessageBody() = default;
+
+    explicit MessageBody(std::string &&heap) : heap_(std::move(heap)), size_(heap_.size()) {}
+
+    MessageBody(std::shared_ptr<MappedBuffer> mapped, size_t size) : mapped_(std::move(mapped)), size_(size) {}
+
+    std::span<const char> Span() const {
+        if (mapped_) {
+            return std::span<const char>(mapped_->data(), size_);
+        }
+        return std::span<const char>(heap_.data(), heap_.size());
+    }
+
+    // Get the contents as a mutable span, e.g. to pass them to a `Requester`
+    std::span<char> MutableSpan() {
+        if (mapped_) {
+            return std::span<char>(mapped_->data(), size_);
+        }
+        return std::span<char>(heap_.data(), heap_.size());
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool IsMapped() const {
+        return mapped_ != nullptr;
+    }
+
+    // Get the heap contents, the body must not be mapped
+    std::string& Heap() {
+        return heap_;
+    }
+
+    // Get the mapping that keeps the mapped body alive
+    const std::shared_ptr<MappedBuffer>& Mapped() const {
+        return mapped_;
+    }
+};
+
+// Settings for spilling the large bodies to the memory-mapped files
+struct SpillOptions {
+    // Bodies larger than this are spilled, 0 disables the spilling. Ignored on Windows.
+    size_t threshold_ = 0;
+    // The directory for the temporary files, the system temporary directory if empty
+    std::string directory_;
+
+    bool Spills(size_t size) const {
+#ifdef _WIN32
+        return false;
+#else
+        return threshold_ != 0 && size > threshold_;
+#endif
+    }
+};
+
+// Accumulates the body received in chunks, moving it to a mapped buffer once it gets larger than
+// the spill threshold.
+class MessageBodyBuilder {
+    // The declared size is not trusted, at most this much is allocated before the data arrives
+    static constexpr size_t MaxReserve = 64 * 1024;
+
+    SpillOptions options_;
+    std::string heap_;
+    std::shared_ptr<MappedBuffer> mapped_;
+    size_t size_ = 0;
+
+    absl::Status Spill(size_t capacity) {
+        auto mapped = MappedBuffer::Create(capacity, options_.directory_);
+        if (!mapped.ok()) {
+            return mapped.status();
+        }
+        mapped_ = std::move(mapped.value());
+        memcpy(mapped_->data(), heap_.data(), size_);
+        std::string().swap(heap_);
+        return absl::OkStatus();
+    }
+
+public:
+    explicit MessageBodyBuilder(const SpillOptions &options) : options_(options) {}
+
+    // Prepare for the body of the expected size (e.g. from the Content-Length header). Only the first
+    // `MaxReserve` bytes are allocated, the buffer grows geometrically as the data arrives.
+    absl::Status Reserve(size_t expected) {
+        size_t capacity = std::min(expected, MaxReserve);
+        if (!mapped_ && !options_.Spills(capacity)) {
+            heap_.reserve(capacity);
+        }
+        return absl::OkStatus();
+    }
+
+    absl::Status Append(const char *data, size_t len) {
+        if (!mapped_ && options_.Spills(size_ + len)) {
+            auto st = Spill(std::max(size_ + len, options_.threshold_ * 2));
+            if (!st.ok()) {
+                return st;
+            }
+        }
+        if (!mapped_) {
+            heap_.append(data, len);
+            size_ += len;
+            return absl::OkStatus();
+        }
+        if (size_ + len > mapped_->capacity()) {
+            // The body is larger than announced (or its size is unknown), grow geometrically
+            auto st = mapped_->Resize(std::max(size_ + len, mapped_->capacity() * 2));
+            if (!st.ok()) {
+                return st;
+            }
+        }
+        memcpy(mapped_->data() + size_, data, len);
+        size_ += len;
+        return absl::OkStatus();
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    MessageBody Finish() {
+        if (mapped_) {
+            return MessageBody(std::move(mapped_), size_);
+        }
+        return MessageBody(std::move(heap_));
+    }
+};
+
+} // namespace trpc
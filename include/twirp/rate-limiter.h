@@ -0,0 +1,132 @@
+// This file contains the lock-free per-key rate limiter used by the rate-limiting server middleware
+// (see `RateLimitMiddleware` in httplib/server-helper.h).
+#pragma once
+
+#include <absl/time/clock.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string_view>
+
+namespace trpc {
+
+// Settings for the RateLimiter.
+struct RateLimiterOptions {
+    // The sustained rate, in requests per second for each key. Zero (or a negative rate) disables
+    // the limit.
+    double rate_ = 100;
+    // The number of requests that can be made at once after the key has been idle
+    double burst_ = 100;
+    // The number of shards, each shard is a separate table
+    size_t shards_ = 16;
+    // The number of keys in each shard. Keys that can't find a free or idle slot are not limited,
+    // so size the table for the expected number of concurrently active keys.
+    size_t slotsPerShard_ = 4096;
+    // Keys that have been idle for this long are evicted and their slots are reused
+    absl::Duration idleTimeout_ = absl::Minutes(1);
+};
+
+// A table of token buckets keyed by the hash of the key (e.g. the user name). The buckets are stored
+// in the GCRA form: a single "theoretical arrival time" per key, which makes the refill lazy and lets
+// each request update its bucket with one compare-and-swap. The tables use open addressing with
+// a bounded probe, idle slots are reclaimed by the requests probing through them.
+class RateLimiter {
+    static constexpr size_t MaxProbe = 16;
+
+    struct alignas(16) Slot {
+        // The key hash, 0 for the empty slots
+        std::atomic<uint64_t> key_ = 0;
+        // The time (in ns) when the bucket becomes full again, anything in the past means "full"
+        std::atomic<int64_t> tat_ = 0;
+    };
+
+    RateLimiterOptions options_;
+    bool unlimited_;
+    size_t numShards_;
+    size_t slotsPerShard_;
+    int64_t intervalNs_;
+    int64_t toleranceNs_;
+    int64_t idleNs_;
+    std::unique_ptr<Slot[]> slots_;
+
+    Slot *FindSlot(uint64_t hash, int64_t now) {
+        Slot *shard = &slots_[(hash >> 32) % numShards_ * slotsPerShard_];
+        size_t start = hash % slotsPerShard_;
+        size_t probe = std::min(MaxProbe, slotsPerShard_);
+        // The key can be anywhere in the probe window: the slots before it might have been freed
+        // or become idle since it was inserted
+        for (size_t i = 0; i < probe; i++) {
+            Slot &slot = shard[(start + i) % slotsPerShard_];
+            if (slot.key_.load(std::memory_order_acquire) == hash) {
+                return &slot;
+            }
+        }
+
+        for (size_t i = 0; i < probe; i++) {
+            Slot &slot = shard[(start + i) % slotsPerShard_];
+            uint64_t key = slot.key_.load(std::memory_order_acquire);
+            // A slot idle for long enough holds a full bucket, so it can be taken over without resetting it
+            bool idle = key != 0 && slot.tat_.load(std::memory_order_relaxed) + idleNs_ < now;
+            if ((key == 0 || idle) && slot.key_.compare_exchange_strong(key, hash)) {
+                return &slot;
+            }
+            if (key == hash) {
+                // Another thread has just inserted the same key
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    explicit RateLimiter(const RateLimiterOptions &options = RateLimiterOptions()) :
+        options_(options), unlimited_(!(options.rate_ > 0)), numShards_(std::max<size_t>(options.shards_, 1)),
+        slotsPerShard_(std::max<size_t>(options.slotsPerShard_, 1)),
+        intervalNs_(unlimited_ ? 0 : static_cast<int64_t>(1e9 / options.rate_)),
+        toleranceNs_(unlimited_ ? 0 : static_cast<int64_t>(1e9 / options.rate_ * (std::max(options.burst_, 1.0) - 1))),
+        idleNs_(std::max(absl::ToInt64Nanoseconds(options.idleTimeout_), toleranceNs_ + intervalNs_)),
+        slots_(unlimited_ ? nullptr : new Slot[numShards_ * slotsPerShard_]) {}
+
+    RateLimiter(const RateLimiter&) = delete; // non construction-copyable
+    RateLimiter& operator = (const RateLimiter&) = delete; // non copyable
+
+    static std::shared_ptr<RateLimiter> make(const RateLimiterOptions &options = RateLimiterOptions()) {
+        return std::make_shared<RateLimiter>(options);
+    }
+
+    // Take a token from the bucket of the key with the given hash.
+    // retryAfter - set to the time until the next token is available if the request is rejected
+    // returns - true if the request is allowed
+    bool TryAcquire(uint64_t hash, absl::Duration *retryAfter) {
+        if (unlimited_) {
+            return true;
+        }
+        hash = hash == 0 ? 1 : hash;
+        int64_t now = absl::GetCurrentTimeNanos();
+        Slot *slot = FindSlot(hash, now);
+        if (!slot) {
+            // The table is full of active keys, don't limit the key that can't be tracked
+            return true;
+        }
+
+        int64_t tat = slot->tat_.load(std::memory_order_relaxed);
+        while (true) {
+            int64_t start = std::max(tat, now);
+            if (start - now > toleranceNs_) {
+                *retryAfter = absl::Nanoseconds(start - now - toleranceNs_);
+                return false;
+            }
+            if (slot->tat_.compare_exchange_weak(tat, start + intervalNs_, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+    // Take a token from the bucket of the given key.
+    bool TryAcquire(std::string_view key, absl::Duration *retryAfter) {
+        return TryAcquire(std::hash<std::string_view>()(key), retryAfter);
+    }
+};
+
+} // namespace trpc
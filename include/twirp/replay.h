@@ -0,0 +1,409 @@
+// This file contains the replay harness for the traffic captured by `CaptureLog` (see capture.h). The captured
+// requests are sent to a service host in-process or to a server over HTTP, at the original or scaled timing,
+// and the per-method latencies can be compared between the builds.
+// See https://github.com/Cyberax/twirp-cpp/blob/development/example/cpp/tw-replay.cpp for the usage example.
+#pragma once
+
+#include <twirp/capture.h>
+#include <twirp/load-generator.h>
+#include <absl/container/flat_hash_map.h>
+#include <istream>
+#include <sstream>
+#include <thread>
+
+namespace trpc {
+
+// A captured request. The views point into the mapping owned by the `CaptureReader`.
+struct CaptureRecord {
+    absl::Time received_;
+    std::string_view service_;
+    std::string_view method_;
+    bool json_;
+    // The context keys with their values, the values are empty if they were not strings
+    std::vector<std::pair<std::string_view, std::string_view>> context_;
+    std::span<char> body_;
+
+    // The key used to group the replay results, e.g. "twirp.example.WeatherService/FindWeatherStation"
+    std::string Route() const {
+        std::string res(service_);
+        res += "/";
+        res += method_;
+        return res;
+    }
+};
+
+// Reads the capture log. The log can be read while it's still being written, the records that
+// are not yet complete are skipped.
+class CaptureReader {
+    char *data_;
+    size_t size_;
+    std::vector<CaptureRecord> records_;
+
+    CaptureReader(char *data, size_t size) : data_(data), size_(size) {}
+
+    template<class T> static bool Get(char *&pos, const char *end, T *res) {
+        if (static_cast<size_t>(end - pos) < sizeof(T)) {
+            return false;
+        }
+        memcpy(res, pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    absl::Status Parse() {
+        const auto *header = reinterpret_cast<const CaptureLogHeader*>(data_);
+        if (size_ < CaptureLogHeader::DataOffset || header->magic_ != CaptureLogHeader::Magic) {
+            return absl::InvalidArgumentError("Not a capture log");
+        }
+        uint64_t used = std::min<uint64_t>({header->tail_.load(), header->capacity_, size_ - CaptureLogHeader::DataOffset});
+
+        char *pos = data_ + CaptureLogHeader::DataOffset;
+        char *end = pos + used;
+        char *committedEnd = pos + std::min<uint64_t>(header->committedEnd_.load(std::memory_order_acquire), used);
+        while (static_cast<size_t>(end - pos) >= sizeof(CaptureRecordHeader)) {
+            auto *rec = reinterpret_cast<CaptureRecordHeader*>(pos);
+            size_t size = rec->size_.load(std::memory_order_acquire);
+            // The writer publishes the size right after reserving the record, give it a moment
+            for (int i = 0; size == 0 && pos < committedEnd && i < 1000; i++) {
+                std::this_thread::yield();
+                size = rec->size_.load(std::memory_order_acquire);
+            }
+            if (size < sizeof(CaptureRecordHeader) || size % 8 != 0 || size > static_cast<size_t>(end - pos)) {
+                if (pos >= committedEnd) {
+                    // The writers have reserved the rest of the log but haven't committed anything there yet
+                    break;
+                }
+                // The committed records after this one can't be found without its size
+                return absl::DataLossError("Corrupted capture record size");
+            }
+            char *next = pos + size;
+            if (rec->committed_.load(std::memory_order_acquire) == 0) {
+                pos = next;
+                continue;
+            }
+
+            // The parts are summed in 64 bits, so that the corrupted sizes can't wrap around
+            uint64_t partsSize = uint64_t(sizeof(CaptureRecordHeader)) + rec->serviceSize_ + rec->methodSize_ +
+                rec->contextSize_ + rec->bodySize_;
+            if (partsSize > size) {
+                return absl::DataLossError("Corrupted capture record sizes");
+            }
+
+            CaptureRecord res;
+            res.received_ = absl::FromUnixNanos(rec->timestampNs_);
+            res.json_ = rec->json_ != 0;
+            char *cur = pos + sizeof(CaptureRecordHeader);
+            res.service_ = std::string_view(cur, rec->serviceSize_);
+            cur += rec->serviceSize_;
+            res.method_ = std::string_view(cur, rec->methodSize_);
+            cur += rec->methodSize_;
+            char *contextEnd = cur + rec->contextSize_;
+            while (cur < contextEnd) {
+                uint32_t sizes[2];
+                if (!Get(cur, contextEnd, &sizes) ||
+                    uint64_t(sizes[0]) + sizes[1] > static_cast<uint64_t>(contextEnd - cur)) {
+                    return absl::DataLossError("Corrupted capture record context");
+                }
+                res.context_.emplace_back(std::string_view(cur, sizes[0]), std::string_view(cur + sizes[0], sizes[1]));
+                cur += sizes[0] + sizes[1];
+            }
+            res.body_ = std::span<char>(cur, rec->bodySize_);
+            records_.push_back(std::move(res));
+            pos = next;
+        }
+
+        // The concurrent writers may reserve their records slightly out of order
+        std::stable_sort(records_.begin(), records_.end(), [](const CaptureRecord &a, const CaptureRecord &b) {
+            return a.received_ < b.received_;
+        });
+        return absl::OkStatus();
+    }
+
+public:
+    ~CaptureReader() {
+#ifndef _WIN32
+        munmap(data_, size_);
+#endif
+    }
+
+    CaptureReader(const CaptureReader&) = delete; // non construction-copyable
+    CaptureReader& operator = (const CaptureReader&) = delete; // non copyable
+
+    static absl::StatusOr<std::shared_ptr<CaptureReader>> Open(const std::string &path) {
+#ifdef _WIN32
+        return absl::UnimplementedError("Traffic capture is not supported");
+#else
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return absl::NotFoundError("Can't open the capture log " + path + ": " + strerror(errno));
+        }
+        struct stat st = {};
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < CaptureLogHeader::DataOffset) {
+            close(fd);
+            return absl::InvalidArgumentError("Not a capture log: " + path);
+        }
+        // A private mapping, so that the bodies can be passed to the requesters that take mutable spans
+        void *addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            return absl::ResourceExhaustedError("Can't map the capture log " + path + ": " + strerror(errno));
+        }
+
+        std::shared_ptr<CaptureReader> res(new CaptureReader(static_cast<char*>(addr), st.st_size));
+        auto parsed = res->Parse();
+        if (!parsed.ok()) {
+            return parsed;
+        }
+        return res;
+#endif
+    }
+
+    // The captured records ordered by their timestamps
+    const std::vector<CaptureRecord>& Records() const {
+        return records_;
+    }
+};
+
+// Settings for the replay
+struct ReplayOptions {
+    // The number of concurrent workers
+    size_t concurrency_ = 8;
+    // The replay speed relative to the captured timing, e.g. 2 replays the traffic twice as fast.
+    // The requests are scheduled regardless of how fast the target responds, and the latency is
+    // measured from the scheduled start time. Zero sends the requests as fast as possible.
+    double speed_ = 1;
+};
+
+// The latency summary of a single route, it can be saved and compared with the other builds
+struct RouteSummary {
+    uint64_t count_ = 0;
+    uint64_t errors_ = 0;
+    absl::Duration p50_;
+    absl::Duration p90_;
+    absl::Duration p99_;
+    absl::Duration max_;
+};
+
+typedef std::map<std::string, RouteSummary> ReplaySummary;
+
+// The results of a replay run.
+struct ReplayReport {
+    absl::Duration elapsed_;
+    // Latencies for each route
+    std::map<std::string, LatencyHistogram> byRoute_;
+    // The number of failed requests for each route and Twirp error code
+    std::map<std::string, std::map<std::string, uint64_t>> errors_;
+
+    ReplaySummary Summarize() const {
+        ReplaySummary res;
+        for (const auto &[route, hist] : byRoute_) {
+            RouteSummary &sum = res[route];
+            sum.count_ = hist.Count();
+            sum.p50_ = hist.Percentile(50);
+            sum.p90_ = hist.Percentile(90);
+            sum.p99_ = hist.Percentile(99);
+            sum.max_ = hist.Max();
+            auto errors = errors_.find(route);
+            if (errors != errors_.end()) {
+                for (const auto &[code, count] : errors->second) {
+                    sum.errors_ += count;
+                }
+            }
+        }
+        return res;
+    }
+
+    // Print the human-readable report
+    void Print(std::ostream &out) const {
+        out << "Replayed in " << elapsed_ << "\n";
+        for (const auto &[route, hist] : byRoute_) {
+            LoadReport::PrintLine(out, route, hist);
+            auto errors = errors_.find(route);
+            if (errors != errors_.end()) {
+                for (const auto &[code, count] : errors->second) {
+                    out << "    " << code << ": " << count << "\n";
+                }
+            }
+        }
+    }
+};
+
+// Save the summary in a line-based text format: the route, the request and error counts and the
+// percentiles in microseconds.
+inline void SaveReplaySummary(const ReplaySummary &summary, std::ostream &out) {
+    for (const auto &[route, sum] : summary) {
+        out << route << " " << sum.count_ << " " << sum.errors_
+            << " " << absl::ToInt64Microseconds(sum.p50_) << " " << absl::ToInt64Microseconds(sum.p90_)
+            << " " << absl::ToInt64Microseconds(sum.p99_) << " " << absl::ToInt64Microseconds(sum.max_) << "\n";
+    }
+}
+
+inline absl::StatusOr<ReplaySummary> LoadReplaySummary(std::istream &in) {
+    ReplaySummary res;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string route;
+        RouteSummary sum;
+        int64_t p50, p90, p99, max;
+        if (!(fields >> route >> sum.count_ >> sum.errors_ >> p50 >> p90 >> p99 >> max)) {
+            return absl::InvalidArgumentError("Malformed replay summary line: " + line);
+        }
+        sum.p50_ = absl::Microseconds(p50);
+        sum.p90_ = absl::Microseconds(p90);
+        sum.p99_ = absl::Microseconds(p99);
+        sum.max_ = absl::Microseconds(max);
+        res[route] = sum;
+    }
+    return res;
+}
+
+// Print the latency changes of the current run relative to the baseline
+inline void PrintReplayDiff(const ReplaySummary &baseline, const ReplaySummary &current, std::ostream &out) {
+    auto change = [](absl::Duration before, absl::Duration after) {
+        std::ostringstream res;
+        res << before << " -> " << after;
+        if (before > absl::ZeroDuration()) {
+            double pct = (absl::FDivDuration(after, before) - 1) * 100;
+            res << " (" << (pct >= 0 ? "+" : "") << static_cast<int64_t>(pct) << "%)";
+        }
+        return res.str();
+    };
+
+    for (const auto &[route, cur] : current) {
+        auto base = baseline.find(route);
+        if (base == baseline.end()) {
+            out << "  " << route << ": not in the baseline\n";
+            continue;
+        }
+        const RouteSummary &old = base->second;
+        out << "  " << route << ": p50=" << change(old.p50_, cur.p50_)
+            << " p90=" << change(old.p90_, cur.p90_)
+            << " p99=" << change(old.p99_, cur.p99_)
+            << " errors=" << old.errors_ << " -> " << cur.errors_ << "\n";
+    }
+    for (const auto &[route, old] : baseline) {
+        if (current.find(route) == current.end()) {
+            out << "  " << route << ": not replayed\n";
+        }
+    }
+}
+
+// A single replayed request
+typedef std::function<absl::Status(const CaptureRecord&)> ReplayCall;
+
+// Restores the request context from the captured keys and values, used for the in-process replay
+typedef std::function<void(const CaptureRecord&, RequestContext*)> ContextRestorer;
+
+// Replay the requests by invoking the service hosts directly, bypassing the HTTP stack. The response
+// is serialized as well, so the result covers all the work done by the server handler after the
+// middlewares. The hosts must outlive the returned call.
+inline ReplayCall MakeInProcessReplay(const std::vector<ServiceHostBase*> &hosts,
+    ContextRestorer restorer = ContextRestorer()) {
+
+    absl::flat_hash_map<std::string_view, ServiceHostBase*> byName;
+    for (auto *host : hosts) {
+        byName[host->GetServiceName()] = host;
+    }
+
+    return [byName = std::move(byName), restorer = std::move(restorer)](const CaptureRecord &rec) -> absl::Status {
+        auto host = byName.find(rec.service_);
+        if (host == byName.end()) {
+            auto res = absl::NotFoundError("Unknown service");
+            res.SetPayload(TwirpStatusKey, absl::Cord("bad_route"));
+            return res;
+        }
+
+        gp::Arena arena;
+        RequestContext ctx;
+        if (restorer) {
+            restorer(rec, &ctx);
+        }
+        auto res = host->second->Invoke(&arena, rec.method_, rec.body_, rec.json_, &ctx);
+        if (!res.ok()) {
+            absl::Status status = res.status();
+            MarkServerError(status);
+            return status;
+        }
+        return SerializeMessage(res.value().get(), rec.json_).status();
+    };
+}
+
+// Replay the requests through the requester (e.g. `HttplibRequester`). The captured record is passed
+// as the requester context (`const CaptureRecord*`), so the client middlewares can restore the
+// headers from the captured context values. The requester is used concurrently, create a call per
+// worker if it's not thread-safe.
+inline ReplayCall MakeRequesterReplay(std::shared_ptr<Requester> requester) {
+    return [requester = std::move(requester)](const CaptureRecord &rec) -> absl::Status {
+        gp::Arena arena;
+        return requester->MakeRequestBody(&arena, const_cast<CaptureRecord*>(&rec), rec.body_, rec.json_,
+            rec.service_, rec.method_).status();
+    };
+}
+
+// Replay the captured records. `makeCall` is invoked once per worker (from the worker's thread) to
+// create the worker's call function.
+inline ReplayReport RunReplay(const std::vector<CaptureRecord> &records, const ReplayOptions &options,
+    const std::function<ReplayCall(size_t)> &makeCall) {
+
+    std::atomic<size_t> next = 0;
+    size_t concurrency = std::max<size_t>(options.concurrency_, 1);
+    std::vector<std::map<std::string, LatencyHistogram>> results(concurrency);
+    std::vector<std::map<std::string, std::map<std::string, uint64_t>>> errors(concurrency);
+
+    absl::Time start = absl::Now() + absl::Milliseconds(100); // Give the workers a head start
+    absl::Time origin = records.empty() ? absl::Time() : records.front().received_;
+
+    auto worker = [&](size_t id) {
+        ReplayCall call = makeCall(id);
+        while (true) {
+            size_t seq = next++;
+            if (seq >= records.size()) {
+                break;
+            }
+            const CaptureRecord &rec = records[seq];
+            absl::Time scheduled;
+            if (options.speed_ > 0) {
+                scheduled = start + (rec.received_ - origin) / options.speed_;
+                absl::SleepFor(scheduled - absl::Now());
+            } else {
+                absl::SleepFor(start - absl::Now());
+                scheduled = absl::Now();
+            }
+
+            absl::Status status = call(rec);
+            std::string route = rec.Route();
+            results[id][route].Record(absl::Now() - scheduled);
+            if (!status.ok()) {
+                errors[id][route][TwirpErrorCode(status)]++;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < concurrency; i++) {
+        threads.emplace_back(worker, i);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    ReplayReport report;
+    report.elapsed_ = absl::Now() - start;
+    for (size_t i = 0; i < concurrency; i++) {
+        for (const auto &[route, hist] : results[i]) {
+            report.byRoute_[route].Merge(hist);
+        }
+        for (const auto &[route, codes] : errors[i]) {
+            for (const auto &[code, count] : codes) {
+                report.errors_[route][code] += count;
+            }
+        }
+    }
+    return report;
+}
+
+} // namespace trpc
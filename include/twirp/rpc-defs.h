@@ -4,6 +4,8 @@
 #include <span>
 #include <any>
 #include <absl/status/statusor.h>
+#include <twirp/error-defs.h>
+#include <twirp/mapped-buffer.h>
 #include <google/protobuf/message.h>
 #include <google/protobuf/util/json_util.h>
 #include <absl/container/node_hash_map.h>
@@ -16,6 +18,16 @@ namespace gp = google::protobuf;
 // absl::Status payload key that you can set to override the returned Twirp error code.
 static constexpr absl::string_view TwirpStatusKey = "twirp_status";
 
+// Mark the error as returned by the server: set its Twirp error code as the TwirpStatusKey payload,
+// unless it's already there. The requesters do this for the errors they decode, so the errors
+// without the payload are the client-side failures (e.g. connection errors).
+inline void MarkServerError(absl::Status &status) {
+    if (!status.ok() && !status.GetPayload(TwirpStatusKey).has_value()) {
+        auto code = StatusToErrorCode(status.code()).first;
+        status.SetPayload(TwirpStatusKey, absl::Cord(absl::string_view(code.data(), code.size())));
+    }
+}
+
 // Deleter for the objects that MIGHT be allocated inside an arena. It does nothing for these objects
 // while deleting normally-allocated objects with `delete`.
 template<class T> struct ArenaDeleter
@@ -52,8 +64,46 @@ public:
     virtual absl::StatusOr<std::string> MakeRequest(gp::Arena *arena,
         void *context, const std::span<char> &data, bool json,
         std::string_view service, std::string_view method) = 0;
+
+    // Make a request, the response body may be returned in a memory-mapped buffer if it's large. The
+    // generated clients use this method, the default implementation calls `MakeRequest`.
+    virtual absl::StatusOr<MessageBody> MakeRequestBody(gp::Arena *arena,
+        void *context, const std::span<char> &data, bool json,
+        std::string_view service, std::string_view method) {
+        auto res = MakeRequest(arena, context, data, json, service, method);
+        if (!res.ok()) {
+            return res.status();
+        }
+        return MessageBody(std::move(res.value()));
+    }
+
+    // The spilling settings for the request bodies serialized by the generated clients, disabled
+    // by default.
+    virtual SpillOptions GetSpillOptions() const {
+        return SpillOptions();
+    }
+};
+
+// A concept for the concrete transports used by the templated generated clients (`<Service>ClientT<T>`).
+// The calls are resolved at compile time instead of going through the virtual `Requester`.
+// path - the precomputed route path, e.g. "/twirp/pkg.Service/Method"
+// service, method - the names for the middlewares and tracing
+template<typename T> concept RequestTransport = requires(T t, gp::Arena *arena, void *context,
+    const std::span<char> &data, bool json, const char *path, std::string_view name) {
+    { t.MakeRoutedRequest(arena, context, data, json, path, name, name) } ->
+        std::same_as<absl::StatusOr<MessageBody>>;
 };
 
+// Get the spilling settings of the transport, spilling is disabled for the transports without
+// the `GetSpillOptions` method.
+template<class T> SpillOptions TransportSpillOptions(const T &transport) {
+    if constexpr (requires { { transport.GetSpillOptions() } -> std::convertible_to<SpillOptions>; }) {
+        return transport.GetSpillOptions();
+    } else {
+        return SpillOptions();
+    }
+}
+
 // A concept for the request context keys. The keys are used to store and
 // retrieve context-bound data with type safety. A typical use-case is to set
 // the authentication data in middleware and consume it inside the remote method
@@ -130,6 +180,15 @@ public:
     }
 };
 
+// The priority class of a method, used by the server to decide which requests to shed first when it's
+// overloaded. Set with the `(twirp.cpp.priority)` method option (see `include/twirp/options.proto`) or
+// per method in the server options.
+enum class Priority : uint8_t {
+    kLow,
+    kNormal,
+    kHigh,
+};
+
 // The pure virtual class representing the service host. Implementations of it are generated by the
 // `protoc-gen-twirpcpp` generator based on the Protobuf schema.
 class ServiceHostBase {
@@ -139,6 +198,11 @@ public:
     virtual std::string_view GetServiceName() const = 0;
     virtual const std::set<std::string_view>& GetMethods() const = 0;
 
+    // Get the priority class of the method from its Protobuf options
+    virtual Priority GetMethodPriority(std::string_view method) const {
+        return Priority::kNormal;
+    }
+
     virtual StatusOrPtr<gp::Message> Invoke(gp::Arena *arena,
         const std::string_view &method, const std::span<const char> &argument1, bool json,
         RequestContext *context) = 0;
@@ -163,6 +227,37 @@ inline absl::StatusOr<std::string> SerializeMessage(const gp::Message *req, bool
     return std::move(res);
 }
 
+// Serialize the given message, binary protobuf messages larger than the spill threshold are serialized
+// directly into a memory-mapped buffer. JSON messages are always serialized to the heap.
+inline absl::StatusOr<MessageBody> SerializeMessageBody(const gp::Message *msg, bool toJson,
+    const SpillOptions &spill) {
+
+    if (!toJson) {
+        size_t size = msg->ByteSizeLong();
+        if (spill.Spills(size)) {
+            // Protobuf can't serialize messages larger than 2Gb
+            if (size >= INT_MAX) {
+                return absl::OutOfRangeError("Message size is too large");
+            }
+            auto mapped = MappedBuffer::Create(size, spill.directory_);
+            if (!mapped.ok()) {
+                return mapped.status();
+            }
+            auto *start = reinterpret_cast<uint8_t*>(mapped.value()->data());
+            if (msg->SerializeWithCachedSizesToArray(start) != start + size) {
+                return absl::InvalidArgumentError("Failed to serialize the message");
+            }
+            return MessageBody(std::move(mapped.value()), size);
+        }
+    }
+
+    auto res = SerializeMessage(msg, toJson);
+    if (!res.ok()) {
+        return res.status();
+    }
+    return MessageBody(std::move(res.value()));
+}
+
 // Deserialize the given protobuf message of type `T`. `json` specifies the encoding
 // of the message (protobuf binary or protobuf JSON). The arena is optional and can be `nullptr`.
 template<class T> StatusOrPtr<T> DeserializeMessage(
@@ -184,7 +279,7 @@ template<class T> StatusOrPtr<T> DeserializeMessage(
             return std::move(res);
         }
     } else {
-        bool ok = resObj->ParseFromString(gp::StringPiece(data.data(), (int)data.size()));
+        bool ok = resObj->ParseFromArray(data.data(), (int)data.size());
         if (!ok) {
             auto res = absl::Status(absl::StatusCode::kInvalidArgument,
                 "Can't deserialize binary request");
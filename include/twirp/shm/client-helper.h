@@ -0,0 +1,99 @@
+// This file contains the shared-memory requester for calling Twirp services in another process on the same
+// host, without the TCP and HTTP overhead. The server side is in server-helper.h in this directory.
+#pragma once
+
+#include <twirp/rpc-defs.h>
+#include <twirp/shm/shm-ring.h>
+#include <mutex>
+
+namespace trpc {
+
+// The requester that sends the requests through the shared-memory segment created by `ShmServer`.
+// The segment has a single request ring, so the concurrent calls are serialized. Only one requester
+// can be attached to a segment at a time, use a separate segment (and server) for each client process.
+// The segment held by a client process that has died is taken over by the next requester.
+class ShmRequester : public trpc::Requester {
+    std::unique_ptr<ShmSegment> segment_;
+    ShmRing requests_;
+    ShmRing responses_;
+    absl::Duration timeout_;
+
+    std::mutex mutex_;
+    std::string buffer_;
+public:
+    // segment - the opened shared-memory segment
+    // timeout - the maximum time to wait for the server's response
+    ShmRequester(std::unique_ptr<ShmSegment> segment, absl::Duration timeout) :
+        segment_(std::move(segment)), requests_(segment_->Requests()), responses_(segment_->Responses()),
+        timeout_(timeout) {}
+
+    ~ShmRequester() override {
+        segment_->DetachClient();
+    }
+
+    ShmRequester(const ShmRequester&) = delete; // non construction-copyable
+    ShmRequester& operator = (const ShmRequester&) = delete; // non copyable
+
+    // Attach to the segment created by the server.
+    // name - the POSIX shared memory name, e.g. "/my-service"
+    static absl::StatusOr<std::shared_ptr<ShmRequester>> make(const std::string &name,
+        absl::Duration timeout = absl::Seconds(10)) {
+
+        auto segment = ShmSegment::Open(name);
+        if (!segment.ok()) {
+            return segment.status();
+        }
+        auto st = segment.value()->AttachClient();
+        if (!st.ok()) {
+            return st;
+        }
+        return std::make_shared<ShmRequester>(std::move(segment.value()), timeout);
+    }
+
+    absl::StatusOr<std::string> MakeRequest(gp::Arena *arena, void *context, const std::span<char> &data,
+        bool json, std::string_view service, std::string_view method) override {
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        absl::Time deadline = absl::Now() + timeout_;
+
+        uint64_t callId = segment_->Header()->lastCallId_.fetch_add(1) + 1;
+        ShmRequestHeader header{callId, static_cast<uint32_t>(service.size()),
+            static_cast<uint32_t>(method.size()), static_cast<uint32_t>(data.size()), json};
+        auto st = requests_.Write({
+            std::span(reinterpret_cast<const char*>(&header), sizeof(header)),
+            std::span(service.data(), service.size()),
+            std::span(method.data(), method.size()),
+            std::span<const char>(data.data(), data.size())}, deadline);
+        if (!st.ok()) {
+            return st;
+        }
+
+        while (true) {
+            st = responses_.Read(&buffer_, deadline);
+            if (!st.ok()) {
+                return st;
+            }
+
+            ShmResponseHeader resp;
+            std::array<std::string_view, 3> parts;
+            st = ParseShmMessage<ShmResponseHeader, 3>(buffer_, &resp, {&ShmResponseHeader::messageSize_,
+                &ShmResponseHeader::payloadsSize_, &ShmResponseHeader::bodySize_}, &parts);
+            if (!st.ok()) {
+                return st;
+            }
+            // Skip the late responses to the calls that have timed out
+            if (resp.callId_ != header.callId_) {
+                continue;
+            }
+
+            if (resp.code_ != 0) {
+                absl::Status res = DecodeShmStatus(resp.code_, parts[0], parts[1]);
+                MarkServerError(res);
+                return res;
+            }
+            return std::string(parts[2]);
+        }
+    }
+};
+
+} // namespace trpc
@@ -0,0 +1,146 @@
+// This file contains the shared-memory server for Twirp services, it serves the requests sent by
+// `ShmRequester` (see client-helper.h in this directory) from another process on the same host.
+#pragma once
+
+#include <twirp/rpc-defs.h>
+#include <twirp/shm/shm-ring.h>
+#include <absl/container/flat_hash_map.h>
+
+namespace trpc {
+
+// Serves the requests from a single shared-memory client. The requests are dispatched to the registered
+// service hosts one by one on the thread that calls `Serve`. The HTTP middlewares don't apply here,
+// the service methods get an empty `RequestContext`.
+class ShmServer {
+    std::unique_ptr<ShmSegment> segment_;
+    ShmRing requests_;
+    ShmRing responses_;
+    // Keyed by the full service name, e.g. "twitch.twirp.example.Haberdasher"
+    absl::flat_hash_map<std::string, ServiceHostBase*> services_;
+    absl::Duration responseTimeout_ = absl::Seconds(10);
+
+    absl::Status SendResponse(uint64_t callId, const absl::Status &status, std::string_view body) {
+        std::string payloads = EncodeShmPayloads(status);
+        ShmResponseHeader header{callId, static_cast<int32_t>(status.code()),
+            static_cast<uint32_t>(status.message().size()), static_cast<uint32_t>(payloads.size()),
+            static_cast<uint32_t>(body.size())};
+        return responses_.Write({
+            std::span(reinterpret_cast<const char*>(&header), sizeof(header)),
+            std::span(status.message().data(), status.message().size()),
+            std::span(payloads.data(), payloads.size()),
+            std::span(body.data(), body.size())}, absl::Now() + responseTimeout_);
+    }
+
+    absl::StatusOr<std::string> Dispatch(std::string_view service, std::string_view method,
+        std::string_view body, bool json) {
+
+        auto pos = services_.find(std::string(service));
+        if (pos == services_.end() || !pos->second->GetMethods().contains(method)) {
+            auto res = absl::UnimplementedError("Unknown method: " + std::string(service) + "/" + std::string(method));
+            res.SetPayload(TwirpStatusKey, absl::Cord("bad_route"));
+            return res;
+        }
+
+        gp::Arena arena;
+        trpc::RequestContext ctx;
+        auto methodResult = pos->second->Invoke(&arena, method, std::span(body.data(), body.size()), json, &ctx);
+        if (!methodResult.ok()) {
+            return methodResult.status();
+        }
+        return trpc::SerializeMessage(methodResult.value().get(), json);
+    }
+
+public:
+    explicit ShmServer(std::unique_ptr<ShmSegment> segment) :
+        segment_(std::move(segment)), requests_(segment_->Requests()), responses_(segment_->Responses()) {}
+
+    ShmServer(const ShmServer&) = delete; // non construction-copyable
+    ShmServer& operator = (const ShmServer&) = delete; // non copyable
+
+    // Create the shared-memory segment for the server, it's removed when the server is destroyed.
+    // name - the POSIX shared memory name, e.g. "/my-service"
+    // capacity - the size of the request and response rings, larger messages are rejected
+    // replace - replace the existing segment with the same name (e.g. left by a crashed server),
+    // otherwise `make` fails with `already_exists`
+    static absl::StatusOr<std::unique_ptr<ShmServer>> make(const std::string &name,
+        size_t capacity = DefaultShmRingCapacity, bool replace = false) {
+
+        auto segment = ShmSegment::Create(name, capacity, replace);
+        if (!segment.ok()) {
+            return segment.status();
+        }
+        return std::make_unique<ShmServer>(std::move(segment.value()));
+    }
+
+    // Register the service host, must be called before `Serve`. The host must outlive the server.
+    void RegisterService(ServiceHostBase *host) {
+        services_[std::string(host->GetServiceName())] = host;
+    }
+
+    // Set the maximum time to wait for the client to make room for a response. The response is dropped
+    // if the client doesn't read it in time, e.g. if it has stopped.
+    void SetResponseTimeout(absl::Duration timeout) {
+        responseTimeout_ = timeout;
+    }
+
+    // Serve the requests until `Stop` is called. The malformed requests are answered with `data_loss`
+    // (or dropped with the rest of the request ring if the ring itself is corrupted) and the serving
+    // continues.
+    absl::Status Serve() {
+        std::string buffer;
+        while (true) {
+            auto st = requests_.Read(&buffer, absl::InfiniteFuture());
+            if (absl::IsUnavailable(st) && segment_->Header()->stopped_.load()) {
+                return absl::OkStatus();
+            }
+            if (absl::IsDataLoss(st)) {
+                requests_.Discard();
+                continue;
+            }
+            if (!st.ok()) {
+                return st;
+            }
+
+            ShmRequestHeader header;
+            std::array<std::string_view, 3> parts;
+            st = ParseShmMessage<ShmRequestHeader, 3>(buffer, &header, {&ShmRequestHeader::serviceSize_,
+                &ShmRequestHeader::methodSize_, &ShmRequestHeader::bodySize_}, &parts);
+            if (!st.ok()) {
+                if (buffer.size() >= sizeof(header)) {
+                    st = SendResponse(header.callId_, st, std::string_view());
+                }
+                if (absl::IsUnavailable(st) && segment_->Header()->stopped_.load()) {
+                    return absl::OkStatus();
+                }
+                continue;
+            }
+
+            auto res = Dispatch(parts[0], parts[1], parts[2], header.json_ != 0);
+            if (res.ok()) {
+                st = SendResponse(header.callId_, absl::OkStatus(), res.value());
+                if (absl::IsOutOfRange(st)) {
+                    st = SendResponse(header.callId_, st, std::string_view());
+                }
+            } else {
+                st = SendResponse(header.callId_, res.status(), std::string_view());
+            }
+            if (absl::IsUnavailable(st) && segment_->Header()->stopped_.load()) {
+                return absl::OkStatus();
+            }
+            if (!st.ok() && !absl::IsDeadlineExceeded(st)) {
+                return st;
+            }
+            // The client has not read the response in time and is treated as gone. Its next call (or
+            // the next client) skips the responses left in the ring by their call IDs.
+        }
+    }
+
+    // Stop the server, can be called from any thread. The waiting client calls fail with `unavailable`.
+    void Stop() {
+        segment_->Header()->stopped_.store(1);
+        requests_.WakeAll();
+        responses_.WakeAll();
+    }
+};
+
+} // namespace trpc
@@ -0,0 +1,462 @@
+// This file contains the shared-memory segment and the single-producer/single-consumer rings used by the
+// same-host transport, see client-helper.h and server-helper.h in this directory. The segment contains
+// two rings: requests (client to server) and responses (server to client). Linux-only, the blocked
+// readers and writers are woken up using futexes.
+#pragma once
+
+#ifndef __linux__
+#error "The shared-memory transport is supported only on Linux"
+#endif
+
+#include <absl/status/statusor.h>
+#include <absl/strings/cord.h>
+#include <absl/time/clock.h>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <span>
+#include <string>
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace trpc {
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+    "futex words must be plain 32-bit integers");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring positions must be lock-free");
+
+// The default size of each ring in the segment
+constexpr size_t DefaultShmRingCapacity = 4 * 1024 * 1024;
+
+// Wait until the futex word changes from `expected` or the timeout expires. The futex is not
+// private since the word is shared between processes.
+inline void FutexWait(std::atomic<uint32_t> *word, uint32_t expected, absl::Duration timeout) {
+    struct timespec ts = absl::ToTimespec(timeout);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+inline void FutexWakeAll(std::atomic<uint32_t> *word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// The control block of a ring, it lives in the shared memory. The positions grow monotonically,
+// the producer and consumer fields are kept on separate cache lines.
+struct ShmRingControl {
+    // Written by the producer
+    alignas(64) std::atomic<uint64_t> head_;
+    // Incremented after each write, the consumer sleeps on it
+    std::atomic<uint32_t> written_;
+    // Set by the producer while it's sleeping
+    std::atomic<uint32_t> producerWaiting_;
+
+    // Written by the consumer
+    alignas(64) std::atomic<uint64_t> tail_;
+    // Incremented after each read, the producer sleeps on it
+    std::atomic<uint32_t> read_;
+    // Set by the consumer while it's sleeping
+    std::atomic<uint32_t> consumerWaiting_;
+};
+
+// The header of the segment, followed by the data of the request and response rings
+struct ShmSegmentHeader {
+    uint64_t magic_;
+    uint64_t capacity_;
+    // Set when the server is stopped, wakes up everybody
+    std::atomic<uint32_t> stopped_;
+    // The last issued call ID. The IDs are never reused, so a client doesn't accept the late responses
+    // to the calls of the previous clients.
+    std::atomic<uint64_t> lastCallId_;
+    ShmRingControl requests_;
+    ShmRingControl responses_;
+};
+
+// A process-local view of one of the rings. Messages are stored as a 4-byte length followed by the
+// data, padded to 8 bytes, and wrap around the end of the ring.
+class ShmRing {
+    // How many times to check the ring before going to sleep
+    static constexpr int SpinCount = 256;
+    // The sleeping threads wake up periodically to check that the channel is not stopped
+    static constexpr absl::Duration MaxSleep = absl::Milliseconds(100);
+
+    ShmRingControl *control_;
+    char *data_;
+    uint64_t capacity_;
+    const std::atomic<uint32_t> *stopped_;
+
+    static void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    static uint64_t Padded(uint64_t size) {
+        return (size + 7) & ~uint64_t(7);
+    }
+
+    // Wait until `ready` returns true, sleeping on the futex `seq`
+    template<class Ready> absl::Status Wait(std::atomic<uint32_t> *seq, std::atomic<uint32_t> *waiting,
+        absl::Time deadline, const Ready &ready) const {
+
+        for (int i = 0; i < SpinCount; i++) {
+            if (ready()) {
+                return absl::OkStatus();
+            }
+            CpuRelax();
+        }
+
+        while (true) {
+            uint32_t current = seq->load();
+            waiting->store(1);
+            // Re-check after announcing the wait, the other side checks `waiting` after updating the ring
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ready()) {
+                waiting->store(0);
+                return absl::OkStatus();
+            }
+            if (stopped_->load()) {
+                waiting->store(0);
+                return absl::UnavailableError("The shared-memory channel is stopped");
+            }
+            absl::Duration left = deadline - absl::Now();
+            if (left <= absl::ZeroDuration()) {
+                waiting->store(0);
+                return absl::DeadlineExceededError("Timed out waiting for the shared-memory channel");
+            }
+            FutexWait(seq, current, std::min(left, MaxSleep));
+            waiting->store(0);
+        }
+    }
+
+    void CopyIn(uint64_t pos, const char *src, size_t size) {
+        uint64_t offset = pos % capacity_;
+        size_t first = std::min<uint64_t>(size, capacity_ - offset);
+        memcpy(data_ + offset, src, first);
+        memcpy(data_, src + first, size - first);
+    }
+
+    void CopyOut(uint64_t pos, char *dst, size_t size) const {
+        uint64_t offset = pos % capacity_;
+        size_t first = std::min<uint64_t>(size, capacity_ - offset);
+        memcpy(dst, data_ + offset, first);
+        memcpy(dst + first, data_, size - first);
+    }
+
+public:
+    ShmRing(ShmRingControl *control, char *data, uint64_t capacity, const std::atomic<uint32_t> *stopped) :
+        control_(control), data_(data), capacity_(capacity), stopped_(stopped) {}
+
+    // Write the message made of the concatenated `parts`, waiting for the free space until the deadline.
+    // Messages that are larger than the ring are rejected with `out_of_range`.
+    absl::Status Write(std::initializer_list<std::span<const char>> parts, absl::Time deadline) {
+        uint64_t size = 0;
+        for (const auto &part : parts) {
+            size += part.size();
+        }
+        uint64_t total = Padded(sizeof(uint32_t) + size);
+        if (size > UINT32_MAX || total > capacity_) {
+            return absl::OutOfRangeError("The message is larger than the shared-memory ring");
+        }
+
+        uint64_t head = control_->head_.load(std::memory_order_relaxed);
+        auto status = Wait(&control_->read_, &control_->producerWaiting_, deadline, [&]() {
+            return head + total - control_->tail_.load(std::memory_order_acquire) <= capacity_;
+        });
+        if (!status.ok()) {
+            return status;
+        }
+
+        auto size32 = static_cast<uint32_t>(size);
+        CopyIn(head, reinterpret_cast<const char*>(&size32), sizeof(size32));
+        uint64_t pos = head + sizeof(size32);
+        for (const auto &part : parts) {
+            CopyIn(pos, part.data(), part.size());
+            pos += part.size();
+        }
+        control_->head_.store(head + total, std::memory_order_release);
+
+        control_->written_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (control_->consumerWaiting_.load()) {
+            FutexWakeAll(&control_->written_);
+        }
+        return absl::OkStatus();
+    }
+
+    // Read the next message into `out`, waiting for it until the deadline. The message size comes
+    // from the other process, so it's checked against the ring before anything is copied.
+    absl::Status Read(std::string *out, absl::Time deadline) {
+        uint64_t tail = control_->tail_.load(std::memory_order_relaxed);
+        uint64_t head = tail;
+        auto status = Wait(&control_->written_, &control_->consumerWaiting_, deadline, [&]() {
+            head = control_->head_.load(std::memory_order_acquire);
+            return head != tail;
+        });
+        if (!status.ok()) {
+            return status;
+        }
+
+        uint64_t available = head - tail;
+        if (available < sizeof(uint32_t) || available > capacity_) {
+            return absl::DataLossError("Corrupted shared-memory ring position");
+        }
+        uint32_t size;
+        CopyOut(tail, reinterpret_cast<char*>(&size), sizeof(size));
+        if (size > available - sizeof(size)) {
+            return absl::DataLossError("Corrupted shared-memory message size");
+        }
+        out->resize(size);
+        CopyOut(tail + sizeof(size), out->data(), size);
+        control_->tail_.store(tail + Padded(sizeof(size) + size), std::memory_order_release);
+
+        control_->read_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (control_->producerWaiting_.load()) {
+            FutexWakeAll(&control_->read_);
+        }
+        return absl::OkStatus();
+    }
+
+    // Drop all the written messages, used by the consumer to resynchronize after a corrupted message.
+    void Discard() {
+        control_->tail_.store(control_->head_.load(std::memory_order_acquire), std::memory_order_release);
+        control_->read_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (control_->producerWaiting_.load()) {
+            FutexWakeAll(&control_->read_);
+        }
+    }
+
+    // Wake up the sleeping reader and writer (used after the channel is stopped)
+    void WakeAll() {
+        control_->written_.fetch_add(1);
+        control_->read_.fetch_add(1);
+        FutexWakeAll(&control_->written_);
+        FutexWakeAll(&control_->read_);
+    }
+};
+
+// A mapping of the shared-memory segment. The server creates the segment (and removes it when
+// it's destroyed) and the client opens it by name.
+class ShmSegment {
+    static constexpr uint64_t Magic = 0x31707269777454ull; // "Twirp1"
+
+    std::string name_;
+    bool owner_;
+    // The descriptor kept open by the clients, they lock it while attached
+    int fd_;
+    void *addr_;
+    size_t size_;
+
+    ShmSegment(std::string name, bool owner, int fd, void *addr, size_t size) :
+        name_(std::move(name)), owner_(owner), fd_(fd), addr_(addr), size_(size) {}
+
+    static absl::Status ErrnoError(const std::string &what, const std::string &name) {
+        return absl::UnavailableError(what + " " + name + ": " + strerror(errno));
+    }
+
+    char *RingData(int index) const {
+        return static_cast<char*>(addr_) + Padded(sizeof(ShmSegmentHeader)) + index * Header()->capacity_;
+    }
+
+    static size_t Padded(size_t size) {
+        return (size + 63) & ~size_t(63);
+    }
+
+public:
+    ~ShmSegment() {
+        munmap(addr_, size_);
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+        if (owner_) {
+            shm_unlink(name_.c_str());
+        }
+    }
+
+    ShmSegment(const ShmSegment&) = delete; // non construction-copyable
+    ShmSegment& operator = (const ShmSegment&) = delete; // non copyable
+
+    // Create the segment. If a segment with the same name exists, it fails with `already_exists`
+    // unless `replace` is set.
+    // name - the POSIX shared memory name, e.g. "/my-service"
+    // capacity - the size of each ring in bytes
+    // replace - remove the existing segment (e.g. left by a crashed server)
+    static absl::StatusOr<std::unique_ptr<ShmSegment>> Create(const std::string &name, size_t capacity,
+        bool replace = false) {
+        capacity = (capacity + 7) & ~size_t(7);
+        size_t size = Padded(sizeof(ShmSegmentHeader)) + 2 * capacity;
+
+        if (replace) {
+            shm_unlink(name.c_str());
+        }
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            return absl::AlreadyExistsError("The shared memory segment already exists: " + name);
+        }
+        if (fd < 0) {
+            return ErrnoError("Can't create the shared memory segment", name);
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            auto res = ErrnoError("Can't resize the shared memory segment", name);
+            close(fd);
+            shm_unlink(name.c_str());
+            return res;
+        }
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            auto res = ErrnoError("Can't map the shared memory segment", name);
+            shm_unlink(name.c_str());
+            return res;
+        }
+
+        auto *header = new (addr) ShmSegmentHeader();
+        header->capacity_ = capacity;
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic_ = Magic;
+        return std::unique_ptr<ShmSegment>(new ShmSegment(name, true, -1, addr, size));
+    }
+
+    // Open the segment created by the server.
+    static absl::StatusOr<std::unique_ptr<ShmSegment>> Open(const std::string &name) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) {
+            return ErrnoError("Can't open the shared memory segment", name);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ShmSegmentHeader)) {
+            close(fd);
+            return absl::UnavailableError("The shared memory segment is not initialized: " + name);
+        }
+        auto size = static_cast<size_t>(st.st_size);
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            auto res = ErrnoError("Can't map the shared memory segment", name);
+            close(fd);
+            return res;
+        }
+
+        std::unique_ptr<ShmSegment> res(new ShmSegment(name, false, fd, addr, size));
+        const ShmSegmentHeader *header = res->Header();
+        if (header->magic_ != Magic || Padded(sizeof(ShmSegmentHeader)) + 2 * header->capacity_ != size) {
+            return absl::UnavailableError("The shared memory segment is not initialized: " + name);
+        }
+        return res;
+    }
+
+    ShmSegmentHeader *Header() const {
+        return static_cast<ShmSegmentHeader*>(addr_);
+    }
+
+    // Attach as the client of the opened segment. The attached client holds an exclusive lock on the
+    // segment, which the kernel releases when the client process dies, so the segment of a dead client
+    // is taken over by the next one.
+    absl::Status AttachClient() {
+        if (flock(fd_, LOCK_EX | LOCK_NB) != 0) {
+            if (errno == EWOULDBLOCK) {
+                return absl::FailedPreconditionError("Another client is attached to the shared memory segment: " +
+                    name_);
+            }
+            return ErrnoError("Can't lock the shared memory segment", name_);
+        }
+        return absl::OkStatus();
+    }
+
+    void DetachClient() {
+        flock(fd_, LOCK_UN);
+    }
+
+    ShmRing Requests() const {
+        return ShmRing(&Header()->requests_, RingData(0), Header()->capacity_, &Header()->stopped_);
+    }
+
+    ShmRing Responses() const {
+        return ShmRing(&Header()->responses_, RingData(1), Header()->capacity_, &Header()->stopped_);
+    }
+};
+
+// The fixed-size part of the request message, followed by the service name, the method name and the body
+struct ShmRequestHeader {
+    uint64_t callId_;
+    uint32_t serviceSize_;
+    uint32_t methodSize_;
+    uint32_t bodySize_;
+    uint32_t json_;
+};
+
+// The fixed-size part of the response message, followed by the error message, the error payloads
+// (each as the key and value sizes followed by the key and value) and the body
+struct ShmResponseHeader {
+    uint64_t callId_;
+    int32_t code_;
+    uint32_t messageSize_;
+    uint32_t payloadsSize_;
+    uint32_t bodySize_;
+};
+
+// Split the message read from the ring into the fixed-size header and the variable-sized parts
+template<class Header, size_t N> absl::Status ParseShmMessage(std::string_view msg, Header *header,
+    const std::array<uint32_t Header::*, N> &sizes, std::array<std::string_view, N> *parts) {
+
+    if (msg.size() < sizeof(Header)) {
+        return absl::DataLossError("Truncated shared-memory message");
+    }
+    memcpy(header, msg.data(), sizeof(Header));
+    size_t pos = sizeof(Header);
+    for (size_t i = 0; i < N; i++) {
+        uint32_t size = header->*sizes[i];
+        if (msg.size() - pos < size) {
+            return absl::DataLossError("Truncated shared-memory message");
+        }
+        (*parts)[i] = msg.substr(pos, size);
+        pos += size;
+    }
+    return absl::OkStatus();
+}
+
+// Encode the status payloads for the response message
+inline std::string EncodeShmPayloads(const absl::Status &status) {
+    std::string res;
+    status.ForEachPayload([&res](absl::string_view key, const absl::Cord &value) {
+        auto sizes = std::array<uint32_t, 2>{static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())};
+        res.append(reinterpret_cast<const char*>(sizes.data()), sizeof(sizes));
+        res.append(key.data(), key.size());
+        for (absl::string_view chunk : value.Chunks()) {
+            res.append(chunk.data(), chunk.size());
+        }
+    });
+    return res;
+}
+
+// Decode the error status from the response message
+inline absl::Status DecodeShmStatus(int32_t code, std::string_view message, std::string_view payloads) {
+    absl::Status res(static_cast<absl::StatusCode>(code), absl::string_view(message.data(), message.size()));
+    while (!payloads.empty()) {
+        std::array<uint32_t, 2> sizes;
+        if (payloads.size() < sizeof(sizes)) {
+            return absl::DataLossError("Truncated shared-memory message");
+        }
+        memcpy(sizes.data(), payloads.data(), sizeof(sizes));
+        payloads.remove_prefix(sizeof(sizes));
+        if (payloads.size() < uint64_t(sizes[0]) + sizes[1]) {
+            return absl::DataLossError("Truncated shared-memory message");
+        }
+        res.SetPayload(absl::string_view(payloads.data(), sizes[0]),
+            absl::Cord(absl::string_view(payloads.data() + sizes[0], sizes[1])));
+        payloads.remove_prefix(sizes[0] + sizes[1]);
+    }
+    return res;
+}
+
+} // namespace trpc
@@ -0,0 +1,339 @@
+// This file contains the sampled per-request phase tracing for Twirp clients and servers. The phase
+// timestamps are collected into lock-free per-thread ring buffers and can be flushed in the Chrome
+// trace-event format (https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU),
+// viewable in chrome://tracing or https://ui.perfetto.dev
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/time/clock.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace trpc {
+
+// The HTTP header used to pass the trace ID from the client to the server. Requests with this header
+// are traced by the server if it has tracing enabled and trusts the incoming trace IDs, so that the
+// client and server spans line up.
+constexpr std::string_view TraceIdHeader = "X-Twirp-Trace-Id";
+
+// The phases of the request processing
+enum class TracePhase : uint8_t {
+    // The whole server-side request, labeled with the method name
+    kRequest,
+    kContentType,
+    kReadBody,
+    kMiddleware,
+    kDecode,
+    kValidate,
+    kHandler,
+    kEncode,
+    // Writing the response into the socket
+    kWrite,
+    // The whole client-side request, labeled with the method name
+    kClient,
+};
+
+inline std::string_view TracePhaseName(TracePhase phase) {
+    switch (phase) {
+        case TracePhase::kRequest: return "request";
+        case TracePhase::kContentType: return "content_type";
+        case TracePhase::kReadBody: return "read_body";
+        case TracePhase::kMiddleware: return "middleware";
+        case TracePhase::kDecode: return "decode";
+        case TracePhase::kValidate: return "validate";
+        case TracePhase::kHandler: return "handler";
+        case TracePhase::kEncode: return "encode";
+        case TracePhase::kWrite: return "write";
+        case TracePhase::kClient: return "client";
+    }
+    return "unknown";
+}
+
+// Collects the sampled phase timestamps. Each thread writes into its own ring buffer without any
+// locking, older events are overwritten if the buffer isn't flushed in time.
+class Tracer {
+public:
+    // A single recorded phase
+    struct Event {
+        uint64_t traceId_;
+        int64_t startNs_;
+        int64_t endNs_;
+        TracePhase phase_;
+        // Optional label (e.g. the method name), must point to a string that outlives the tracer
+        std::string_view label_;
+        uint32_t thread_;
+    };
+
+private:
+    // The fields are atomics so that the flushing thread can read them while the owner thread is
+    // writing. The slot is a seqlock: `seq_` is odd while the slot is being written and `2 * (position + 1)`
+    // once the event at that position is published, so the torn and overwritten events are discarded.
+    struct Slot {
+        std::atomic<uint64_t> seq_;
+        std::atomic<uint64_t> traceId_;
+        std::atomic<int64_t> startNs_;
+        std::atomic<int64_t> endNs_;
+        std::atomic<const char*> label_;
+        std::atomic<uint32_t> labelSize_;
+        std::atomic<TracePhase> phase_;
+    };
+
+    struct Ring {
+        std::unique_ptr<Slot[]> slots_;
+        size_t capacity_;
+        uint32_t thread_;
+        // Written only by the owner thread
+        std::atomic<uint64_t> head_ = 0;
+        // The number of requests seen by `Sample` on the owner thread
+        uint64_t sampled_ = 0;
+        // Accessed only by the flushing thread under `Tracer::mutex_`
+        uint64_t flushed_ = 0;
+
+        Ring(size_t capacity, uint32_t thread) : slots_(new Slot[capacity]), capacity_(capacity), thread_(thread) {}
+    };
+
+    static uint64_t NextTracerId() {
+        static std::atomic<uint64_t> counter = 0;
+        return ++counter;
+    }
+
+    const uint64_t id_ = NextTracerId();
+    const size_t capacity_;
+    std::atomic<uint32_t> sampleEvery_;
+
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+
+    Ring *ThreadRing() {
+        // Cache the ring of the most recently used tracer for this thread
+        thread_local uint64_t cachedTracer = 0;
+        thread_local Ring *cachedRing = nullptr;
+        thread_local absl::flat_hash_map<uint64_t, std::shared_ptr<Ring>> threadRings;
+        if (cachedTracer == id_) {
+            return cachedRing;
+        }
+
+        auto &ring = threadRings[id_];
+        if (!ring) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ring = std::make_shared<Ring>(capacity_, static_cast<uint32_t>(rings_.size()));
+            rings_.push_back(ring);
+        }
+        cachedTracer = id_;
+        cachedRing = ring.get();
+        return cachedRing;
+    }
+
+public:
+    // sampleEvery - trace one request out of this many on each thread, 0 disables the sampling
+    // capacity - the number of events in each per-thread ring buffer
+    explicit Tracer(uint32_t sampleEvery = 0, size_t capacity = 16384) :
+        capacity_(capacity), sampleEvery_(sampleEvery) {}
+
+    Tracer(const Tracer&) = delete; // non construction-copyable
+    Tracer& operator = (const Tracer&) = delete; // non copyable
+
+    static std::shared_ptr<Tracer> make(uint32_t sampleEvery = 0, size_t capacity = 16384) {
+        return std::make_shared<Tracer>(sampleEvery, capacity);
+    }
+
+    // Change the sampling rate, 0 disables the tracing
+    void SetSampleEvery(uint32_t sampleEvery) {
+        sampleEvery_.store(sampleEvery, std::memory_order_relaxed);
+    }
+
+    // Check if the tracing is enabled, requests with the trusted incoming trace ID are traced only if it is.
+    bool Enabled() const {
+        return sampleEvery_.load(std::memory_order_relaxed) != 0;
+    }
+
+    // Decide if a new request should be traced, returns the new trace ID or 0.
+    uint64_t Sample() {
+        uint32_t every = sampleEvery_.load(std::memory_order_relaxed);
+        if (every == 0) {
+            return 0;
+        }
+        // The counter lives in the thread's ring, so each tracer samples its own requests
+        if (++ThreadRing()->sampled_ % every != 0) {
+            return 0;
+        }
+        return NewTraceId();
+    }
+
+    static uint64_t NewTraceId() {
+        static std::atomic<uint64_t> sequence = 0;
+        // Mix the time and the sequence to make IDs from different processes unlikely to collide
+        uint64_t res = static_cast<uint64_t>(absl::GetCurrentTimeNanos()) * 0x9E3779B97F4A7C15ull + (++sequence);
+        return res == 0 ? 1 : res;
+    }
+
+    // Record the phase into the current thread's ring buffer.
+    void Record(uint64_t traceId, TracePhase phase, int64_t startNs, int64_t endNs,
+        std::string_view label = std::string_view()) {
+
+        Ring *ring = ThreadRing();
+        uint64_t head = ring->head_.load(std::memory_order_relaxed);
+        Slot &slot = ring->slots_[head % ring->capacity_];
+        slot.seq_.store(2 * head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.traceId_.store(traceId, std::memory_order_relaxed);
+        slot.startNs_.store(startNs, std::memory_order_relaxed);
+        slot.endNs_.store(endNs, std::memory_order_relaxed);
+        slot.label_.store(label.data(), std::memory_order_relaxed);
+        slot.labelSize_.store(static_cast<uint32_t>(label.size()), std::memory_order_relaxed);
+        slot.phase_.store(phase, std::memory_order_relaxed);
+        slot.seq_.store(2 * head + 2, std::memory_order_release);
+        ring->head_.store(head + 1, std::memory_order_release);
+    }
+
+    // Collect the events recorded since the previous call.
+    std::vector<Event> Collect() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<Event> res;
+        for (auto &ring : rings_) {
+            uint64_t head = ring->head_.load(std::memory_order_acquire);
+            uint64_t from = std::max(ring->flushed_, head > ring->capacity_ ? head - ring->capacity_ : 0);
+            for (uint64_t i = from; i < head; i++) {
+                Slot &slot = ring->slots_[i % ring->capacity_];
+                uint64_t seq = slot.seq_.load(std::memory_order_acquire);
+                if (seq != 2 * i + 2) {
+                    // Overwritten by a newer event, or being overwritten right now
+                    continue;
+                }
+                Event event{
+                    slot.traceId_.load(std::memory_order_relaxed),
+                    slot.startNs_.load(std::memory_order_relaxed),
+                    slot.endNs_.load(std::memory_order_relaxed),
+                    slot.phase_.load(std::memory_order_relaxed),
+                    std::string_view(slot.label_.load(std::memory_order_relaxed),
+                        slot.labelSize_.load(std::memory_order_relaxed)),
+                    ring->thread_,
+                };
+                // Keep the event only if the slot hasn't been rewritten while we were reading it
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.seq_.load(std::memory_order_relaxed) == seq) {
+                    res.push_back(event);
+                }
+            }
+            ring->flushed_ = head;
+        }
+        return res;
+    }
+
+    // Write the string contents with the JSON escaping (without the quotes)
+    static void WriteJsonString(std::ostream &out, std::string_view str) {
+        static constexpr char Hex[] = "0123456789abcdef";
+        for (char c : str) {
+            auto u = static_cast<unsigned char>(c);
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            } else if (u < 0x20) {
+                out << "\\u00" << Hex[u >> 4] << Hex[u & 0xF];
+            } else {
+                out << c;
+            }
+        }
+    }
+
+    // Write the events recorded since the previous flush in the Chrome trace-event JSON format.
+    // pid - the process ID to report, it separates the client and server tracks when their traces
+    // are loaded together.
+    void Flush(std::ostream &out, uint64_t pid) {
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        for (const auto &ev : Collect()) {
+            out << (first ? "\n" : ",\n");
+            first = false;
+            out << "{\"name\":\"" << TracePhaseName(ev.phase_);
+            if (!ev.label_.empty()) {
+                out << " ";
+                WriteJsonString(out, ev.label_);
+            }
+            out << "\",\"cat\":\"twirp\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << ev.thread_
+                << ",\"ts\":" << ev.startNs_ / 1000 << "." << (ev.startNs_ / 100) % 10
+                << ",\"dur\":" << (ev.endNs_ - ev.startNs_) / 1000 << "." << ((ev.endNs_ - ev.startNs_) / 100) % 10
+                << ",\"args\":{\"trace_id\":\"" << std::hex << ev.traceId_ << std::dec << "\"}}";
+        }
+        out << "\n]}\n";
+    }
+};
+
+// The trace of the request that is being processed by the current thread. The generated service
+// hosts use it through `TraceScope` to record their phases.
+struct ActiveTrace {
+    Tracer *tracer_ = nullptr;
+    uint64_t traceId_ = 0;
+
+    static ActiveTrace& Current() {
+        thread_local ActiveTrace current;
+        return current;
+    }
+};
+
+// Makes the trace active for the current thread until the object is destroyed
+class ActiveTraceScope {
+    ActiveTrace saved_;
+public:
+    ActiveTraceScope(Tracer *tracer, uint64_t traceId) : saved_(ActiveTrace::Current()) {
+        ActiveTrace::Current() = ActiveTrace{tracer, traceId};
+    }
+    ~ActiveTraceScope() {
+        ActiveTrace::Current() = saved_;
+    }
+    ActiveTraceScope(const ActiveTraceScope&) = delete; // non construction-copyable
+    ActiveTraceScope& operator = (const ActiveTraceScope&) = delete; // non copyable
+};
+
+// Records a phase of the active trace, does nothing (besides a thread-local check) if the current
+// request is not sampled. `Next` closes the current phase and starts the next one.
+class TraceScope {
+    ActiveTrace active_;
+    TracePhase phase_;
+    std::string_view label_;
+    int64_t start_ = 0;
+    bool running_ = true;
+public:
+    explicit TraceScope(TracePhase phase, std::string_view label = std::string_view()) :
+        active_(ActiveTrace::Current()), phase_(phase), label_(label) {
+        if (active_.tracer_) {
+            start_ = absl::GetCurrentTimeNanos();
+        }
+    }
+
+    ~TraceScope() {
+        End();
+    }
+
+    // Close the current phase (if it's not closed yet) and start the next one
+    void Next(TracePhase phase) {
+        if (active_.tracer_) {
+            int64_t now = absl::GetCurrentTimeNanos();
+            if (running_) {
+                active_.tracer_->Record(active_.traceId_, phase_, start_, now, label_);
+            }
+            start_ = now;
+        }
+        phase_ = phase;
+        label_ = std::string_view();
+        running_ = true;
+    }
+
+    // Close the current phase
+    void End() {
+        if (active_.tracer_ && running_) {
+            active_.tracer_->Record(active_.traceId_, phase_, start_, absl::GetCurrentTimeNanos(), label_);
+        }
+        running_ = false;
+    }
+
+    TraceScope(const TraceScope&) = delete; // non construction-copyable
+    TraceScope& operator = (const TraceScope&) = delete; // non copyable
+};
+
+} // namespace trpc
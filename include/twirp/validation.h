@@ -0,0 +1,96 @@
+// This file contains the runtime support for the request validators that `protoc-gen-twirpcpp` generates
+// from the protoc-gen-validate annotations (https://github.com/envoyproxy/protoc-gen-validate).
+// The validators are plain C++ code specialized for each message, they don't use reflection and
+// don't allocate unless a violation is found.
+//
+// Rules that require a regular expression engine or a parser (`pattern`, `email`, `hostname`, `ip`,
+// `uri`, `uuid`, the repeated `unique` rule and the `Any`/`Duration`/`Timestamp` value rules) are not checked.
+// The `ignore_empty` flag is supported for the scalar, string, bytes, repeated and map rules.
+#pragma once
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <absl/status/status.h>
+#include <absl/strings/cord.h>
+
+namespace trpc {
+
+// The path to the field that is being validated. The paths are linked through the stack frames
+// of the generated validators and are rendered into strings only when a violation is found.
+struct FieldPath {
+    // The path of the enclosing message, nullptr for the top-level fields
+    const FieldPath *parent_;
+    // The field name, as it's specified in the Protobuf schema
+    std::string_view name_;
+    // The index of the element within a repeated field, or -1
+    int index_ = -1;
+
+    // Render the path as a string, e.g.: "ws_id.points[2]"
+    std::string ToString() const {
+        std::string res = parent_ ? parent_->ToString() + "." : std::string();
+        res += name_;
+        if (index_ >= 0) {
+            res += "[" + std::to_string(index_) + "]";
+        }
+        return res;
+    }
+};
+
+// The prefix of the error payload keys with the violations, it keeps the field paths apart
+// from the other metadata keys (e.g. `twirp_status`).
+static constexpr std::string_view ViolationKeyPrefix = "violation.";
+
+// Accumulates the violations found by the generated validators.
+class ValidationErrors {
+    std::vector<std::pair<std::string, std::string_view>> violations_;
+public:
+    // Record a violation for the field. `msg` must be a string literal.
+    void Add(const FieldPath &path, std::string_view msg) {
+        violations_.emplace_back(path.ToString(), msg);
+    }
+
+    bool empty() const {
+        return violations_.empty();
+    }
+
+    // Convert the violations into an `invalid_argument` error. The message describes the first
+    // violation and each violating field is added as a payload (passed to the client as the Twirp
+    // error metadata), keyed by `ViolationKeyPrefix` and the field path. Several violations of
+    // the same field are joined with "; ".
+    absl::Status ToStatus() const {
+        if (violations_.empty()) {
+            return absl::OkStatus();
+        }
+        std::string msg = "Invalid " + violations_.front().first + ": ";
+        msg += violations_.front().second;
+        absl::Status res(absl::StatusCode::kInvalidArgument, msg);
+
+        std::map<std::string, std::string> byField;
+        for(const auto &[path, violation] : violations_) {
+            std::string &fieldMsg = byField[std::string(ViolationKeyPrefix) + path];
+            if (!fieldMsg.empty()) {
+                fieldMsg += "; ";
+            }
+            fieldMsg += violation;
+        }
+        for(const auto &[key, fieldMsg] : byField) {
+            res.SetPayload(key, absl::Cord(fieldMsg));
+        }
+        return res;
+    }
+};
+
+// Count the number of UTF-8 code points in the string, used for the `min_len`/`max_len`/`len` rules.
+inline size_t Utf8Length(std::string_view str) {
+    size_t res = 0;
+    for(char c : str) {
+        if ((static_cast<unsigned char>(c) & 0xC0) != 0x80) {
+            res++;
+        }
+    }
+    return res;
+}
+
+} // namespace trpc
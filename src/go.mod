@@ -2,12 +2,14 @@ module github.com/Cyberax/twirpcpp
 
 go 1.17
 
-require github.com/lyft/protoc-gen-star v0.6.0
+require (
+	github.com/lyft/protoc-gen-star v0.6.0
+	google.golang.org/protobuf v1.27.1
+)
 
 require (
 	github.com/davecgh/go-spew v1.1.1 // indirect
 	github.com/golang/protobuf v1.5.2 // indirect
 	github.com/spf13/afero v1.6.0 // indirect
 	golang.org/x/text v0.3.7 // indirect
-	google.golang.org/protobuf v1.27.1 // indirect
 )
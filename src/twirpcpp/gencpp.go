@@ -3,6 +3,7 @@ package twirpcpp
 import (
 	pgs "github.com/lyft/protoc-gen-star"
 	pgsgo "github.com/lyft/protoc-gen-star/lang/go"
+	"google.golang.org/protobuf/types/descriptorpb"
 	"strings"
 	"text/template"
 )
@@ -25,21 +26,28 @@ func (m *Module) Name() string { return "twirpcpp" }
 
 type TemplateData struct {
 	pgs.File
-	Namespace string
-	Services  []pgs.Service
-	FileName  string
+	Namespace       string
+	Services        []pgs.Service
+	FileName        string
+	Validators      *validatorGen
+	TemplatedClient bool
 }
 
 func (m *Module) Execute(targets map[string]pgs.File, _ map[string]pgs.Package) []pgs.Artifact {
 
 	fns := pgsgo.InitContext(m.Parameters())
+	// The header-only clients over a concrete transport, disable with "templated_client=false"
+	templatedClient, err := m.Parameters().BoolDefault("templated_client", true)
+	m.CheckErr(err, "unable to parse the templated_client parameter")
 	funcs := map[string]interface{}{
-		"cmt":         pgs.C80,
-		"name":        fns.Name,
-		"pkg":         fns.PackageName,
-		"typ":         fns.Type,
-		"MakeComment": makeComment,
-		"CppName":     cppName,
+		"cmt":            pgs.C80,
+		"name":           fns.Name,
+		"pkg":            fns.PackageName,
+		"typ":            fns.Type,
+		"MakeComment":    makeComment,
+		"CppName":        cppName,
+		"NoSideEffects":  noSideEffects,
+		"MethodPriority": methodPriority,
 	}
 
 	cppCliHeader := template.New("go")
@@ -64,10 +72,12 @@ func (m *Module) Execute(targets map[string]pgs.File, _ map[string]pgs.Package)
 		//nsp := m.computeNamespace(f)
 		fname := computeFilename(f)
 		td := TemplateData{
-			File:      f,
-			Namespace: cppName(f.File()),
-			FileName:  fname,
-			Services:  f.Services(),
+			File:            f,
+			Namespace:       cppName(f.File()),
+			FileName:        fname,
+			Services:        f.Services(),
+			Validators:      newValidatorGen(f.Services()),
+			TemplatedClient: templatedClient,
 		}
 		m.AddGeneratorTemplateFile(FilePathFor(f, m.ctx, "_client.hpp"), cppCliHeader, td)
 		m.AddGeneratorTemplateFile(FilePathFor(f, m.ctx, "_client.cpp"), cppCliSrc, td)
@@ -131,3 +141,30 @@ func cppName(ent pgs.Entity) string {
 
 	return res
 }
+
+// noSideEffects checks if the method is marked with `option idempotency_level = NO_SIDE_EFFECTS;`,
+// the responses of such methods can be cached by the client.
+func noSideEffects(meth pgs.Method) bool {
+	return meth.Descriptor().GetOptions().GetIdempotencyLevel() == descriptorpb.MethodOptions_NO_SIDE_EFFECTS
+}
+
+// The extension number of the `(twirp.cpp.priority)` method option from include/twirp/options.proto
+const priorityExtension = 50731
+
+// methodPriority returns the trpc::Priority enumerator for the method's `(twirp.cpp.priority)` option,
+// or an empty string for the normal priority. The option is read from the unknown fields, just
+// like the protoc-gen-validate rules.
+func methodPriority(meth pgs.Method) string {
+	opts := meth.Descriptor().GetOptions()
+	if opts == nil {
+		return ""
+	}
+	val, _ := parseWire(opts.ProtoReflect().GetUnknown()).last(priorityExtension)
+	switch val {
+	case 1:
+		return "kLow"
+	case 2:
+		return "kHigh"
+	}
+	return ""
+}
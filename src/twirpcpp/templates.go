@@ -7,6 +7,7 @@ const cppClientHeaderTpl = `// Code generated by protoc-gen-twirpcpp. DO NOT EDI
 
 #include "{{.FileName}}.pb.h"
 #include <twirp/rpc-defs.h>
+#include <twirp/client-cache.h>
 
 {{$nsp := .Namespace -}}
 
@@ -30,9 +31,12 @@ namespace {{$nsp}} {
 class {{$srv.Name}}Client : public {{$srv.Name}}ClientInterface {
     std::shared_ptr<trpc::Requester> requester_;
     bool json_;
+    std::shared_ptr<trpc::ResponseCache> cache_;
 public:
-    {{$srv.Name}}Client(std::shared_ptr<trpc::Requester> requester, bool json) :
-        requester_(std::move(requester)), json_(json) {}
+    // cache - optional cache for the methods marked with 'option idempotency_level = NO_SIDE_EFFECTS'
+    {{$srv.Name}}Client(std::shared_ptr<trpc::Requester> requester, bool json,
+        std::shared_ptr<trpc::ResponseCache> cache = nullptr) :
+        requester_(std::move(requester)), json_(json), cache_(std::move(cache)) {}
 {{ range $meth := $srv.Methods }}
 {{""}}{{MakeComment $meth.SourceCodeInfo.LeadingDetachedComments 4 -}}
 {{""}}{{MakeComment $meth.SourceCodeInfo.LeadingComments 4 -}}
@@ -41,6 +45,85 @@ public:
 {{""}}        const {{CppName $meth.Input}} *req) override ; {{ MakeComment $meth.SourceCodeInfo.TrailingComments 1 -}}
 {{ end }}
 {{""}}};
+{{- if $.TemplatedClient }}
+
+// The route paths of the {{$srv.Name}} methods
+struct {{$srv.Name}}Routes {
+    static constexpr std::string_view ServiceName = "{{$srv.Package.ProtoName}}.{{$srv.Name}}";
+{{- range $meth := $srv.Methods }}
+    static constexpr const char *{{$meth.Name}}Path = "/twirp/{{$srv.Package.ProtoName}}.{{$srv.Name}}/{{$meth.Name}}";
+{{- end }}
+};
+
+// The header-only client for a concrete transport type (e.g. trpc::HttplibRequester). The transport
+// calls are resolved at compile time and can be inlined, and the route paths are not rebuilt for each call.
+template<class Transport> requires trpc::RequestTransport<Transport>
+class {{$srv.Name}}ClientT final : public {{$srv.Name}}ClientInterface {
+    std::shared_ptr<Transport> transport_;
+    bool json_;
+    std::shared_ptr<trpc::ResponseCache> cache_;
+
+    template<class Resp> absl::StatusOr<Resp*> Call(google::protobuf::Arena *arena, void *context,
+        const google::protobuf::Message *req, const char *path, std::string_view method, bool cacheable) {
+
+        absl::StatusOr<trpc::MessageBody> msg = trpc::SerializeMessageBody(req, json_,
+            trpc::TransportSpillOptions(*transport_));
+        if (!msg.ok()) {
+            return msg.status();
+        }
+        std::span<char> data = msg.value().MutableSpan();
+
+        if (cacheable && cache_) {
+            // The method has no side effects, so its responses can be reused
+            auto cached = cache_->GetOrFetch(context, {{$srv.Name}}Routes::ServiceName, method, json_, data,
+                [&]() -> absl::StatusOr<std::string> {
+                    auto body = transport_->MakeRoutedRequest(arena, context, data, json_, path,
+                        {{$srv.Name}}Routes::ServiceName, method);
+                    if (!body.ok()) {
+                        return body.status();
+                    }
+                    return std::string(body.value().Span().data(), body.value().size());
+                });
+            if (!cached.ok()) {
+                return cached.status();
+            }
+
+            absl::StatusOr<trpc::OwnedPtr<Resp>> res = trpc::DeserializeMessage<Resp>(arena, *cached.value(), json_);
+            if (!res.ok()) {
+                return res.status();
+            }
+            return res.value().release();
+        }
+
+        absl::StatusOr<trpc::MessageBody> result = transport_->MakeRoutedRequest(arena, context, data, json_,
+            path, {{$srv.Name}}Routes::ServiceName, method);
+        if (!result.ok()) {
+            return result.status();
+        }
+
+        absl::StatusOr<trpc::OwnedPtr<Resp>> res = trpc::DeserializeMessage<Resp>(arena, result.value().Span(), json_);
+        if (!res.ok()) {
+            return res.status();
+        }
+        return res.value().release();
+    }
+public:
+    // cache - optional cache for the methods marked with 'option idempotency_level = NO_SIDE_EFFECTS'
+    {{$srv.Name}}ClientT(std::shared_ptr<Transport> transport, bool json,
+        std::shared_ptr<trpc::ResponseCache> cache = nullptr) :
+        transport_(std::move(transport)), json_(json), cache_(std::move(cache)) {}
+{{ range $meth := $srv.Methods }}
+{{""}}{{MakeComment $meth.SourceCodeInfo.LeadingDetachedComments 4 -}}
+{{""}}{{MakeComment $meth.SourceCodeInfo.LeadingComments 4 -}}
+{{""}}    absl::StatusOr<{{CppName $meth.Output}}*> {{$meth.Name}}(
+{{""}}        google::protobuf::Arena *arena, void *context,
+{{""}}        const {{CppName $meth.Input}} *req) override {
+{{""}}        return Call<{{CppName $meth.Output}}>(arena, context, req, {{$srv.Name}}Routes::{{$meth.Name}}Path,
+{{""}}            "{{$meth.Name}}", {{ if NoSideEffects $meth }}true{{ else }}false{{ end }});
+{{""}}    }
+{{ end }}
+{{""}}};
+{{- end }}
 {{ end -}}
 {{""}}
 } // namespace {{$nsp}}
@@ -61,20 +144,41 @@ absl::StatusOr<{{CppName $meth.Output}}*> {{CppName $srv}}Client::{{$meth.Name}}
     gp::Arena *arena, void *context,
     const {{CppName $meth.Input}} *req) {
 
-    absl::StatusOr<std::string> msg = trpc::SerializeMessage(req, json_);
+    // The large binary requests are serialized into a memory-mapped buffer if the requester spills them
+    absl::StatusOr<trpc::MessageBody> msg = trpc::SerializeMessageBody(req, json_, requester_->GetSpillOptions());
     if (!msg.ok()) {
         return msg.status();
     }
+    std::span<char> data = msg.value().MutableSpan();
+{{ if NoSideEffects $meth }}
+    if (cache_) {
+        // The method has no side effects, so its responses can be reused
+        auto cached = cache_->GetOrFetch(context, "{{$srv.Package.ProtoName}}.{{$srv.Name}}", "{{$meth.Name}}",
+            json_, data, [&]() {
+                return requester_->MakeRequest(arena, context, data, json_,
+                    "{{$srv.Package.ProtoName}}.{{$srv.Name}}", "{{$meth.Name}}");
+            });
+        if (!cached.ok()) {
+            return cached.status();
+        }
 
+        absl::StatusOr<trpc::OwnedPtr<{{CppName $meth.Output}}>> res =
+            trpc::DeserializeMessage<{{CppName $meth.Output}}>(arena, *cached.value(), json_);
+        if (!res.ok()) {
+            return res.status();
+        }
+        return res.value().release();
+    }
+{{ end }}
     // Invoke the remote side!
-    absl::StatusOr<std::string> result = requester_->MakeRequest(arena, context, msg.value(), json_,
+    absl::StatusOr<trpc::MessageBody> result = requester_->MakeRequestBody(arena, context, data, json_,
         "{{$srv.Package.ProtoName}}.{{$srv.Name}}", "{{$meth.Name}}");
     if (!result.ok()) {
         return result.status();
     }
 
     absl::StatusOr<trpc::OwnedPtr<{{CppName $meth.Output}}>> res =
-        trpc::DeserializeMessage<{{CppName $meth.Output}}>(arena, result.value(), json_);
+        trpc::DeserializeMessage<{{CppName $meth.Output}}>(arena, result.value().Span(), json_);
     if (!res.ok()) {
         return res.status();
     }
@@ -136,6 +240,17 @@ namespace gp = google::protobuf;
 {{""}}        return methods_;
 {{""}}    }
 {{""}}
+{{""}}    trpc::Priority GetMethodPriority(std::string_view method) const override {
+{{ range $meth := $srv.Methods -}}
+{{ with MethodPriority $meth -}}
+{{""}}        if (method == "{{$meth.Name}}") {
+{{""}}            return trpc::Priority::{{.}};
+{{""}}        }
+{{ end -}}
+{{ end -}}
+{{""}}        return trpc::Priority::kNormal;
+{{""}}    }
+{{""}}
 {{""}}    trpc::StatusOrPtr<gp::Message> Invoke(gp::Arena *arena,
 {{""}}        const std::string_view &method, const std::span<const char> &argument1, bool json,
 {{""}}        trpc::RequestContext *context) override;
@@ -149,9 +264,14 @@ const cppServerSrcTpl = `// Code generated by protoc-gen-twirpcpp. DO NOT EDIT.
 // source: {{ .InputPath }}
 // Functionality: implement server Twirp stubs
 #include "{{.FileName}}_server.hpp"
+#include <twirp/validation.h>
+#include <twirp/tracing.h>
 
 namespace gp = google::protobuf;
 {{""}}
+{{- with .Validators.Code }}
+{{ . }}
+{{- end }}
 {{- $nsp := .Namespace -}}
 {{- range $srv := .Services }}
 trpc::StatusOrPtr<gp::Message> {{CppName $srv}}ServiceHost::Invoke(gp::Arena *arena,
@@ -163,12 +283,21 @@ trpc::StatusOrPtr<gp::Message> {{CppName $srv}}ServiceHost::Invoke(gp::Arena *ar
     }
 {{ range $meth := $srv.Methods }}
     if (method == "{{$meth.Name}}") {
+        trpc::TraceScope phase(trpc::TracePhase::kDecode);
         absl::StatusOr<trpc::OwnedPtr<{{CppName $meth.Input}}>> reqObj =
             trpc::DeserializeMessage<{{CppName $meth.Input}}>(arena, argument1, json);
         if (!reqObj.ok()) {
             return reqObj.status();
         }
-
+{{ if $.Validators.Validated $meth.Input }}
+        phase.Next(trpc::TracePhase::kValidate);
+        trpc::ValidationErrors violations;
+        ValidateMessage(*reqObj.value(), nullptr, &violations);
+        if (!violations.empty()) {
+            return violations.ToStatus();
+        }
+{{ end }}
+        phase.Next(trpc::TracePhase::kHandler);
         absl::StatusOr<{{CppName $meth.Output}}*> res = handler_->{{$meth.Name}}(
             arena, context, reqObj.value().get());
         if (!res.ok()) {
@@ -0,0 +1,716 @@
+package twirpcpp
+
+import (
+	"fmt"
+	"math"
+	"strconv"
+	"strings"
+
+	pgs "github.com/lyft/protoc-gen-star"
+	"google.golang.org/protobuf/encoding/protowire"
+)
+
+// The extension number used by protoc-gen-validate for the `validate.rules` (field),
+// `validate.disabled` (message) and `validate.required` (oneof) options.
+const validateExtension = 1071
+
+// Field numbers inside `validate.FieldRules`
+const (
+	rulesBool     = 13
+	rulesString   = 14
+	rulesBytes    = 15
+	rulesEnum     = 16
+	rulesMessage  = 17
+	rulesRepeated = 18
+	rulesMap      = 19
+)
+
+// The `ignore_empty` field numbers, the rules are not checked for the empty (zero) values
+const (
+	numericIgnoreEmpty  = 8
+	stringIgnoreEmpty   = 26
+	bytesIgnoreEmpty    = 14
+	repeatedIgnoreEmpty = 5
+	mapIgnoreEmpty      = 6
+)
+
+// wireFields is a minimally decoded protobuf message, keyed by the field number. It's used to read
+// the protoc-gen-validate options without depending on their generated Go code: the options are
+// not registered in this binary, so protoc passes them to us as unknown fields.
+type wireFields map[protowire.Number][]wireValue
+
+type wireValue struct {
+	typ   protowire.Type
+	num   uint64
+	bytes []byte
+}
+
+func parseWire(b []byte) wireFields {
+	res := wireFields{}
+	for len(b) > 0 {
+		num, typ, n := protowire.ConsumeTag(b)
+		if n < 0 {
+			return res
+		}
+		b = b[n:]
+		val := wireValue{typ: typ}
+		switch typ {
+		case protowire.VarintType:
+			val.num, n = protowire.ConsumeVarint(b)
+		case protowire.Fixed32Type:
+			var v uint32
+			v, n = protowire.ConsumeFixed32(b)
+			val.num = uint64(v)
+		case protowire.Fixed64Type:
+			val.num, n = protowire.ConsumeFixed64(b)
+		case protowire.BytesType:
+			val.bytes, n = protowire.ConsumeBytes(b)
+		default:
+			n = protowire.ConsumeFieldValue(num, typ, b)
+		}
+		if n < 0 {
+			return res
+		}
+		b = b[n:]
+		res[num] = append(res[num], val)
+	}
+	return res
+}
+
+// message returns the embedded message with the given number, merging all of its occurrences.
+func (w wireFields) message(num protowire.Number) wireFields {
+	vals := w[num]
+	if len(vals) == 0 {
+		return nil
+	}
+	var buf []byte
+	for _, v := range vals {
+		if v.typ == protowire.BytesType {
+			buf = append(buf, v.bytes...)
+		}
+	}
+	return parseWire(buf)
+}
+
+// last returns the last occurrence of a scalar field (the protobuf "last one wins" rule).
+func (w wireFields) last(num protowire.Number) (uint64, bool) {
+	vals := w[num]
+	if len(vals) == 0 {
+		return 0, false
+	}
+	return vals[len(vals)-1].num, true
+}
+
+func (w wireFields) flag(num protowire.Number) bool {
+	v, ok := w.last(num)
+	return ok && v != 0
+}
+
+// scalars returns all the values of a repeated scalar field, unpacking the packed encoding.
+func (w wireFields) scalars(num protowire.Number, enc protowire.Type) []uint64 {
+	var res []uint64
+	for _, v := range w[num] {
+		if v.typ != protowire.BytesType {
+			res = append(res, v.num)
+			continue
+		}
+		b := v.bytes
+		for len(b) > 0 {
+			var x uint64
+			var n int
+			switch enc {
+			case protowire.Fixed32Type:
+				var y uint32
+				y, n = protowire.ConsumeFixed32(b)
+				x = uint64(y)
+			case protowire.Fixed64Type:
+				x, n = protowire.ConsumeFixed64(b)
+			default:
+				x, n = protowire.ConsumeVarint(b)
+			}
+			if n < 0 {
+				break
+			}
+			b = b[n:]
+			res = append(res, x)
+		}
+	}
+	return res
+}
+
+func (w wireFields) strings(num protowire.Number) [][]byte {
+	var res [][]byte
+	for _, v := range w[num] {
+		res = append(res, v.bytes)
+	}
+	return res
+}
+
+func fieldRules(f pgs.Field) wireFields {
+	opts := f.Descriptor().GetOptions()
+	if opts == nil {
+		return nil
+	}
+	return parseWire(opts.ProtoReflect().GetUnknown()).message(validateExtension)
+}
+
+func validationDisabled(m pgs.Message) bool {
+	opts := m.Descriptor().GetOptions()
+	if opts == nil {
+		return false
+	}
+	return parseWire(opts.ProtoReflect().GetUnknown()).flag(validateExtension)
+}
+
+func oneofRequired(o pgs.OneOf) bool {
+	opts := o.Descriptor().GetOptions()
+	if opts == nil {
+		return false
+	}
+	return parseWire(opts.ProtoReflect().GetUnknown()).flag(validateExtension)
+}
+
+// numericKind describes how the rules for a numeric field type are encoded.
+type numericKind struct {
+	rules protowire.Number
+	enc   protowire.Type
+	// decode converts the raw value into a C++ literal, a human-readable form and an
+	// approximate value used to detect the exclusive ranges.
+	decode func(v uint64) (string, string, float64)
+}
+
+var numericKinds = map[pgs.ProtoType]numericKind{
+	pgs.FloatT:    {1, protowire.Fixed32Type, decodeFloat},
+	pgs.DoubleT:   {2, protowire.Fixed64Type, decodeDouble},
+	pgs.Int32T:    {3, protowire.VarintType, func(v uint64) (string, string, float64) { return signedLiteral(int64(int32(v))) }},
+	pgs.Int64T:    {4, protowire.VarintType, func(v uint64) (string, string, float64) { return signedLiteral(int64(v)) }},
+	pgs.UInt32T:   {5, protowire.VarintType, unsignedLiteral},
+	pgs.UInt64T:   {6, protowire.VarintType, unsignedLiteral},
+	pgs.SInt32T:   {7, protowire.VarintType, func(v uint64) (string, string, float64) { return signedLiteral(protowire.DecodeZigZag(v)) }},
+	pgs.SInt64T:   {8, protowire.VarintType, func(v uint64) (string, string, float64) { return signedLiteral(protowire.DecodeZigZag(v)) }},
+	pgs.Fixed32T:  {9, protowire.Fixed32Type, unsignedLiteral},
+	pgs.Fixed64T:  {10, protowire.Fixed64Type, unsignedLiteral},
+	pgs.SFixed32T: {11, protowire.Fixed32Type, func(v uint64) (string, string, float64) { return signedLiteral(int64(int32(uint32(v)))) }},
+	pgs.SFixed64T: {12, protowire.Fixed64Type, func(v uint64) (string, string, float64) { return signedLiteral(int64(v)) }},
+}
+
+func signedLiteral(v int64) (string, string, float64) {
+	txt := strconv.FormatInt(v, 10)
+	if v == math.MinInt64 {
+		return "INT64_MIN", txt, float64(v)
+	}
+	return txt + "LL", txt, float64(v)
+}
+
+func unsignedLiteral(v uint64) (string, string, float64) {
+	txt := strconv.FormatUint(v, 10)
+	return txt + "ULL", txt, float64(v)
+}
+
+func floatLiteral(v float64, bits int, cppType string, suffix string) (string, string, float64) {
+	if math.IsNaN(v) {
+		return "std::numeric_limits<" + cppType + ">::quiet_NaN()", "NaN", v
+	}
+	if math.IsInf(v, 1) {
+		return "std::numeric_limits<" + cppType + ">::infinity()", "+Inf", v
+	}
+	if math.IsInf(v, -1) {
+		return "-std::numeric_limits<" + cppType + ">::infinity()", "-Inf", v
+	}
+	txt := strconv.FormatFloat(v, 'g', -1, bits)
+	lit := txt
+	if !strings.ContainsAny(lit, ".e") {
+		lit += ".0"
+	}
+	return lit + suffix, txt, v
+}
+
+func decodeFloat(v uint64) (string, string, float64) {
+	return floatLiteral(float64(math.Float32frombits(uint32(v))), 32, "float", "f")
+}
+
+func decodeDouble(v uint64) (string, string, float64) {
+	return floatLiteral(math.Float64frombits(v), 64, "double", "")
+}
+
+// cppString makes a C++ std::string_view constant, every non-printable byte is escaped with a
+// fixed-length octal sequence so that the following characters can't extend it.
+func cppString(b []byte) string {
+	return fmt.Sprintf("std::string_view(%s, %d)", cppQuote(b), len(b))
+}
+
+func cppQuote(b []byte) string {
+	var sb strings.Builder
+	sb.WriteByte('"')
+	for _, c := range b {
+		switch {
+		case c == '"' || c == '\\':
+			sb.WriteByte('\\')
+			sb.WriteByte(c)
+		case c == '?':
+			// Avoid trigraphs
+			sb.WriteString("\\?")
+		case c >= 0x20 && c < 0x7f:
+			sb.WriteByte(c)
+		default:
+			sb.WriteString(fmt.Sprintf("\\%03o", c))
+		}
+	}
+	sb.WriteByte('"')
+	return sb.String()
+}
+
+// valueType is the common part of pgs.FieldType and pgs.FieldTypeElem.
+type valueType interface {
+	ProtoType() pgs.ProtoType
+	IsEnum() bool
+	Enum() pgs.Enum
+	IsEmbed() bool
+	Embed() pgs.Message
+}
+
+// validatorGen generates the reflection-free validators for the request messages of the services.
+type validatorGen struct {
+	messages    []pgs.Message
+	validatable map[string]bool
+}
+
+func newValidatorGen(services []pgs.Service) *validatorGen {
+	g := &validatorGen{validatable: map[string]bool{}}
+	seen := map[string]bool{}
+	for _, srv := range services {
+		for _, meth := range srv.Methods() {
+			g.visit(meth.Input(), seen)
+		}
+	}
+
+	// A message needs a validator if it has rules of its own or if it contains messages that
+	// have validators. Iterate until no new validators are found.
+	for changed := true; changed; {
+		changed = false
+		for _, msg := range g.messages {
+			name := msg.FullyQualifiedName()
+			if g.validatable[name] || validationDisabled(msg) {
+				continue
+			}
+			if g.messageBody(msg) != "" {
+				g.validatable[name] = true
+				changed = true
+			}
+		}
+	}
+	return g
+}
+
+func (g *validatorGen) visit(msg pgs.Message, seen map[string]bool) {
+	if seen[msg.FullyQualifiedName()] {
+		return
+	}
+	seen[msg.FullyQualifiedName()] = true
+	g.messages = append(g.messages, msg)
+
+	for _, f := range msg.Fields() {
+		typ := f.Type()
+		if typ.IsEmbed() {
+			g.visit(typ.Embed(), seen)
+		}
+		if (typ.IsRepeated() || typ.IsMap()) && typ.Element().IsEmbed() {
+			g.visit(typ.Element().Embed(), seen)
+		}
+	}
+}
+
+// Validated checks if the generated Invoke needs to run the validator for the message
+func (g *validatorGen) Validated(msg pgs.Message) bool {
+	return g.validatable[msg.FullyQualifiedName()]
+}
+
+// Code generates the validator functions, they are placed in an anonymous namespace of the
+// server source file.
+func (g *validatorGen) Code() string {
+	var decls, defs strings.Builder
+	for _, msg := range g.messages {
+		if !g.Validated(msg) {
+			continue
+		}
+		signature := fmt.Sprintf("void ValidateMessage(const %s &msg, const trpc::FieldPath *parent, "+
+			"trpc::ValidationErrors *errors)", cppName(msg))
+		decls.WriteString("[[maybe_unused]] " + signature + ";\n")
+		defs.WriteString("\n" + signature + " {\n" + g.messageBody(msg) + "}\n")
+	}
+	if decls.Len() == 0 {
+		return ""
+	}
+	return "namespace {\n\n" + decls.String() + defs.String() + "\n} // namespace\n"
+}
+
+// cppWriter is a tiny helper for the generated code indentation
+type cppWriter struct {
+	sb     strings.Builder
+	indent int
+}
+
+func (w *cppWriter) line(format string, args ...interface{}) {
+	w.sb.WriteString(strings.Repeat("    ", w.indent))
+	w.sb.WriteString(fmt.Sprintf(format, args...))
+	w.sb.WriteString("\n")
+}
+
+func (w *cppWriter) open(format string, args ...interface{}) {
+	w.line(format+" {", args...)
+	w.indent++
+}
+
+func (w *cppWriter) close() {
+	w.indent--
+	w.line("}")
+}
+
+// check is a single validation rule: if `cond` is true then the violation `msg` is reported
+type check struct {
+	cond string
+	msg  string
+}
+
+func (w *cppWriter) checks(checks []check, pathVar string) {
+	for _, c := range checks {
+		w.open("if (%s)", c.cond)
+		w.line("errors->Add(%s, %s);", pathVar, cppQuote([]byte(c.msg)))
+		w.close()
+	}
+}
+
+func (g *validatorGen) messageBody(msg pgs.Message) string {
+	w := &cppWriter{indent: 1}
+	for _, f := range msg.Fields() {
+		g.fieldChecks(w, f)
+	}
+	for _, o := range msg.OneOfs() {
+		if !oneofRequired(o) {
+			continue
+		}
+		w.open("if (msg.%s_case() == %s::%s_NOT_SET)", strings.ToLower(o.Name().String()),
+			cppName(msg), strings.ToUpper(o.Name().String()))
+		w.line("errors->Add(trpc::FieldPath{parent, %s}, \"value is required\");", cppQuote([]byte(o.Name().String())))
+		w.close()
+	}
+	return w.sb.String()
+}
+
+func (g *validatorGen) fieldChecks(w *cppWriter, f pgs.Field) {
+	rules := fieldRules(f)
+	typ := f.Type()
+	acc := strings.ToLower(f.Name().String())
+	name := cppQuote([]byte(f.Name().String()))
+
+	body := &cppWriter{indent: w.indent + 1}
+	switch {
+	case typ.IsMap():
+		mapRules := rules.message(rulesMap)
+		body.checks(sizeChecks(fmt.Sprintf("msg.%s_size()", acc), mapRules, "pairs", mapIgnoreEmpty), "path")
+		keys := g.elementChecks(typ.Key(), mapRules.message(4), "entry.first", "path")
+		values := g.elementChecks(typ.Element(), mapRules.message(5), "entry.second", "path")
+		if keys != nil || values != nil {
+			body.open("for (const auto &entry : msg.%s())", acc)
+			body.lines(keys)
+			body.lines(values)
+			body.close()
+		}
+	case typ.IsRepeated():
+		repRules := rules.message(rulesRepeated)
+		body.checks(sizeChecks(fmt.Sprintf("msg.%s_size()", acc), repRules, "items", repeatedIgnoreEmpty), "path")
+		items := g.elementChecks(typ.Element(), repRules.message(4), fmt.Sprintf("msg.%s(i)", acc), "elemPath")
+		if items != nil {
+			body.open("for (int i = 0; i < msg.%s_size(); i++)", acc)
+			body.line("trpc::FieldPath elemPath{path.parent_, path.name_, i};")
+			body.lines(items)
+			body.close()
+		}
+	default:
+		if typ.IsEmbed() && rules.message(rulesMessage).flag(2) {
+			body.open("if (!msg.has_%s())", acc)
+			body.line("errors->Add(path, \"value is required\");")
+			body.close()
+		}
+		checks := g.elementChecks(typ, rules, fmt.Sprintf("msg.%s()", acc), "path")
+		if checks != nil {
+			// Oneof members and optional fields are checked only when they are set
+			if typ.IsEmbed() || f.Descriptor().OneofIndex != nil {
+				body.open("if (msg.has_%s())", acc)
+				body.lines(checks)
+				body.close()
+			} else {
+				body.lines(checks)
+			}
+		}
+	}
+
+	if body.sb.Len() == 0 {
+		return
+	}
+	w.open("")
+	w.line("trpc::FieldPath path{parent, %s};", name)
+	w.sb.WriteString(body.sb.String())
+	w.close()
+}
+
+// lines appends a block produced by elementChecks
+func (w *cppWriter) lines(block []string) {
+	for _, l := range block {
+		w.line("%s", l)
+	}
+}
+
+func sizeChecks(size string, rules wireFields, what string, ignoreEmpty protowire.Number) []check {
+	var res []check
+	if v, ok := rules.last(1); ok {
+		cond := fmt.Sprintf("%s < %d", size, v)
+		if rules.flag(ignoreEmpty) {
+			// The empty collections don't have to satisfy the minimum size
+			cond = fmt.Sprintf("%s != 0 && %s", size, cond)
+		}
+		res = append(res, check{cond,
+			fmt.Sprintf("value must contain at least %d %s", v, what)})
+	}
+	if v, ok := rules.last(2); ok {
+		res = append(res, check{fmt.Sprintf("%s > %d", size, v),
+			fmt.Sprintf("value must contain no more than %d %s", v, what)})
+	}
+	return res
+}
+
+// elementChecks generates the checks for a single value. The block is self-contained (wrapped in
+// braces) and reports the violations using the `pathVar` variable. Returns nil if there's nothing
+// to check.
+func (g *validatorGen) elementChecks(typ valueType, rules wireFields, val string, pathVar string) []string {
+	w := &cppWriter{indent: 1}
+
+	// The checks of the scalar values, skipped for the empty values if `guard` is set
+	var checks []check
+	guard := ""
+	if typ.IsEmbed() {
+		if g.Validated(typ.Embed()) && !rules.message(rulesMessage).flag(1) {
+			w.line("ValidateMessage(%s, &%s, errors);", val, pathVar)
+		}
+	} else if typ.IsEnum() {
+		checks = enumChecks(typ.Enum(), rules.message(rulesEnum), "v")
+	} else if kind, ok := numericKinds[typ.ProtoType()]; ok {
+		numRules := rules.message(kind.rules)
+		checks = numericChecks(kind, numRules, "v")
+		if numRules.flag(numericIgnoreEmpty) {
+			guard = "v != 0"
+		}
+	} else if typ.ProtoType() == pgs.BoolT {
+		if v, ok := rules.message(rulesBool).last(1); ok {
+			checks = []check{{fmt.Sprintf("v != %t", v != 0), fmt.Sprintf("value must equal %t", v != 0)}}
+		}
+	} else if typ.ProtoType() == pgs.StringT {
+		strRules := rules.message(rulesString)
+		checks = stringChecks(strRules, "v", false)
+		if strRules.flag(stringIgnoreEmpty) {
+			guard = "!v.empty()"
+		}
+	} else if typ.ProtoType() == pgs.BytesT {
+		bytesRules := rules.message(rulesBytes)
+		checks = stringChecks(bytesRules, "v", true)
+		if bytesRules.flag(bytesIgnoreEmpty) {
+			guard = "!v.empty()"
+		}
+	}
+	if guard != "" && len(checks) > 0 {
+		w.open("if (%s)", guard)
+		w.checks(checks, pathVar)
+		w.close()
+	} else {
+		w.checks(checks, pathVar)
+	}
+
+	if w.sb.Len() == 0 {
+		return nil
+	}
+	block := strings.Split(strings.TrimRight(w.sb.String(), "\n"), "\n")
+	res := []string{"{"}
+	if !typ.IsEmbed() {
+		res = append(res, "    const auto &v = "+val+";")
+	}
+	res = append(res, block...)
+	return append(res, "}")
+}
+
+func numericChecks(kind numericKind, rules wireFields, val string) []check {
+	if rules == nil {
+		return nil
+	}
+	var res []check
+	if v, ok := rules.last(1); ok {
+		lit, txt, _ := kind.decode(v)
+		res = append(res, check{fmt.Sprintf("%s != %s", val, lit), "value must equal " + txt})
+	}
+
+	type bound struct {
+		op, lit, txt, desc string
+		approx             float64
+	}
+	var lower, upper *bound
+	if v, ok := rules.last(2); ok {
+		lit, txt, approx := kind.decode(v)
+		upper = &bound{"<", lit, txt, "less than", approx}
+	}
+	if v, ok := rules.last(3); ok {
+		lit, txt, approx := kind.decode(v)
+		upper = &bound{"<=", lit, txt, "less than or equal to", approx}
+	}
+	if v, ok := rules.last(4); ok {
+		lit, txt, approx := kind.decode(v)
+		lower = &bound{">", lit, txt, "greater than", approx}
+	}
+	if v, ok := rules.last(5); ok {
+		lit, txt, approx := kind.decode(v)
+		lower = &bound{">=", lit, txt, "greater than or equal to", approx}
+	}
+	switch {
+	case lower != nil && upper != nil && lower.approx < upper.approx:
+		res = append(res, check{
+			fmt.Sprintf("!(%s %s %s && %s %s %s)", val, lower.op, lower.lit, val, upper.op, upper.lit),
+			fmt.Sprintf("value must be %s %s and %s %s", lower.desc, lower.txt, upper.desc, upper.txt)})
+	case lower != nil && upper != nil:
+		// An exclusive range: the value must lie outside of [upper, lower]
+		res = append(res, check{
+			fmt.Sprintf("!(%s %s %s || %s %s %s)", val, lower.op, lower.lit, val, upper.op, upper.lit),
+			fmt.Sprintf("value must be %s %s or %s %s", lower.desc, lower.txt, upper.desc, upper.txt)})
+	case lower != nil:
+		res = append(res, check{fmt.Sprintf("!(%s %s %s)", val, lower.op, lower.lit),
+			fmt.Sprintf("value must be %s %s", lower.desc, lower.txt)})
+	case upper != nil:
+		res = append(res, check{fmt.Sprintf("!(%s %s %s)", val, upper.op, upper.lit),
+			fmt.Sprintf("value must be %s %s", upper.desc, upper.txt)})
+	}
+
+	var in, notIn []string
+	var inTxt, notInTxt []string
+	for _, v := range rules.scalars(6, kind.enc) {
+		lit, txt, _ := kind.decode(v)
+		in = append(in, fmt.Sprintf("%s == %s", val, lit))
+		inTxt = append(inTxt, txt)
+	}
+	for _, v := range rules.scalars(7, kind.enc) {
+		lit, txt, _ := kind.decode(v)
+		notIn = append(notIn, fmt.Sprintf("%s == %s", val, lit))
+		notInTxt = append(notInTxt, txt)
+	}
+	return append(res, listChecks(in, inTxt, notIn, notInTxt)...)
+}
+
+func listChecks(in, inTxt, notIn, notInTxt []string) []check {
+	var res []check
+	if len(in) > 0 {
+		res = append(res, check{"!(" + strings.Join(in, " || ") + ")",
+			"value must be in list [" + strings.Join(inTxt, ", ") + "]"})
+	}
+	if len(notIn) > 0 {
+		res = append(res, check{strings.Join(notIn, " || "),
+			"value must not be in list [" + strings.Join(notInTxt, ", ") + "]"})
+	}
+	return res
+}
+
+func enumChecks(enum pgs.Enum, rules wireFields, val string) []check {
+	if rules == nil {
+		return nil
+	}
+	var res []check
+	if v, ok := rules.last(1); ok {
+		res = append(res, check{fmt.Sprintf("static_cast<int>(%s) != %d", val, int32(v)),
+			fmt.Sprintf("value must equal %d", int32(v))})
+	}
+	if rules.flag(2) {
+		res = append(res, check{fmt.Sprintf("!%s_IsValid(%s)", cppName(enum), val),
+			"value must be one of the defined enum values"})
+	}
+	var in, notIn []string
+	var inTxt, notInTxt []string
+	for _, v := range rules.scalars(3, protowire.VarintType) {
+		in = append(in, fmt.Sprintf("static_cast<int>(%s) == %d", val, int32(v)))
+		inTxt = append(inTxt, strconv.Itoa(int(int32(v))))
+	}
+	for _, v := range rules.scalars(4, protowire.VarintType) {
+		notIn = append(notIn, fmt.Sprintf("static_cast<int>(%s) == %d", val, int32(v)))
+		notInTxt = append(notInTxt, strconv.Itoa(int(int32(v))))
+	}
+	return append(res, listChecks(in, inTxt, notIn, notInTxt)...)
+}
+
+// stringChecks generates the checks for the `string` and `bytes` rules. They share the semantics
+// but not the field numbers, and the `bytes` lengths are measured in bytes rather than code points.
+func stringChecks(rules wireFields, val string, bytes bool) []check {
+	if rules == nil {
+		return nil
+	}
+	type lenRule struct {
+		num        protowire.Number
+		op, desc   string
+		codePoints bool
+	}
+	var lens []lenRule
+	var prefix, suffix, contains, in, notIn protowire.Number
+	if bytes {
+		lens = []lenRule{{13, "!=", "value length must be %d bytes", false},
+			{2, "<", "value length must be at least %d bytes", false},
+			{3, ">", "value length must be at most %d bytes", false}}
+		prefix, suffix, contains, in, notIn = 5, 6, 7, 8, 9
+	} else {
+		lens = []lenRule{{19, "!=", "value length must be %d runes", true},
+			{2, "<", "value length must be at least %d runes", true},
+			{3, ">", "value length must be at most %d runes", true},
+			{20, "!=", "value length must be %d bytes", false},
+			{4, "<", "value length must be at least %d bytes", false},
+			{5, ">", "value length must be at most %d bytes", false}}
+		prefix, suffix, contains, in, notIn = 7, 8, 9, 10, 11
+	}
+
+	var res []check
+	for _, c := range rules.strings(1) {
+		res = append(res, check{fmt.Sprintf("%s != %s", val, cppString(c)),
+			"value must equal " + strconv.Quote(string(c))})
+	}
+	for _, l := range lens {
+		v, ok := rules.last(l.num)
+		if !ok {
+			continue
+		}
+		size := val + ".size()"
+		if l.codePoints {
+			size = "trpc::Utf8Length(" + val + ")"
+		}
+		res = append(res, check{fmt.Sprintf("%s %s %dULL", size, l.op, v), fmt.Sprintf(l.desc, v)})
+	}
+	for _, c := range rules.strings(prefix) {
+		res = append(res, check{fmt.Sprintf("!std::string_view(%s).starts_with(%s)", val, cppString(c)),
+			"value does not have prefix " + strconv.Quote(string(c))})
+	}
+	for _, c := range rules.strings(suffix) {
+		res = append(res, check{fmt.Sprintf("!std::string_view(%s).ends_with(%s)", val, cppString(c)),
+			"value does not have suffix " + strconv.Quote(string(c))})
+	}
+	for _, c := range rules.strings(contains) {
+		res = append(res, check{fmt.Sprintf("std::string_view(%s).find(%s) == std::string_view::npos", val, cppString(c)),
+			"value does not contain substring " + strconv.Quote(string(c))})
+	}
+	if !bytes {
+		for _, c := range rules.strings(23) {
+			res = append(res, check{fmt.Sprintf("std::string_view(%s).find(%s) != std::string_view::npos", val, cppString(c)),
+				"value contains substring " + strconv.Quote(string(c))})
+		}
+	}
+
+	var inConds, inTxt, notInConds, notInTxt []string
+	for _, c := range rules.strings(in) {
+		inConds = append(inConds, fmt.Sprintf("%s == %s", val, cppString(c)))
+		inTxt = append(inTxt, strconv.Quote(string(c)))
+	}
+	for _, c := range rules.strings(notIn) {
+		notInConds = append(notInConds, fmt.Sprintf("%s == %s", val, cppString(c)))
+		notInTxt = append(notInTxt, strconv.Quote(string(c)))
+	}
+	return append(res, listChecks(inConds, inTxt, notInConds, notInTxt)...)
+}
@@ -3,6 +3,9 @@
 //
 
 #include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <twirp/load-generator.h>
 #include "service1.pb.h"
 #include "service1_server.hpp"
 #include "service1_client.hpp"
@@ -140,3 +143,256 @@ TEST(RpcTests, error_no_arena_protobuf) {
 TEST(RpcTests, error_no_arena_json) {
     test_error(nullptr, true);
 }
+
+void test_validation(bool json) {
+    auto impl = std::make_shared<SimpleImpl>();
+    WSProviderServiceHost host(impl);
+
+    auto dr = std::make_shared<DirectRequester>(&host);
+    WSProviderClient cli(dr, json);
+
+    // The ID is limited to 256 bytes
+    WeatherStationId id;
+    id.set_id(std::string(300, 'a'));
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &id);
+    EXPECT_EQ(false, res.ok());
+    EXPECT_EQ(true, absl::IsInvalidArgument(res.status()));
+    EXPECT_EQ("value length must be at most 256 bytes", res.status().GetPayload("violation.id").value().Flatten());
+
+    // Points must be less than 999, the validation happens before the method is called
+    WeatherStation station;
+    station.add_points(1);
+    station.add_points(1000);
+    auto updRes = cli.UpdateWeatherStation(nullptr, nullptr, &station);
+    EXPECT_EQ(false, updRes.ok());
+    EXPECT_EQ(true, absl::IsInvalidArgument(updRes.status()));
+    EXPECT_EQ("value must be less than 999", updRes.status().GetPayload("violation.points[1]").value().Flatten());
+
+    // Nested messages are validated as well
+    (*station.mutable_nestedstations())["nested"].mutable_ws_id()->set_id(std::string(300, 'a'));
+    station.clear_points();
+    updRes = cli.UpdateWeatherStation(nullptr, nullptr, &station);
+    EXPECT_EQ(true, absl::IsInvalidArgument(updRes.status()));
+    EXPECT_EQ(true, updRes.status().GetPayload("violation.nestedStations.ws_id.id").has_value());
+
+    // The empty context data is not validated (`ignore_empty`), the call reaches the method
+    WeatherStation other;
+    EXPECT_EQ(true, absl::IsUnimplemented(cli.UpdateWeatherStation(nullptr, nullptr, &other).status()));
+
+    // All the violations of the field are reported
+    other.set_contextdata("!");
+    updRes = cli.UpdateWeatherStation(nullptr, nullptr, &other);
+    EXPECT_EQ(true, absl::IsInvalidArgument(updRes.status()));
+    EXPECT_EQ("value length must be at least 2 bytes; value contains substring \"!\"",
+        updRes.status().GetPayload("violation.contextData").value().Flatten());
+}
+
+TEST(RpcTests, validation_protobuf) {
+    test_validation(false);
+}
+
+TEST(RpcTests, validation_json) {
+    test_validation(true);
+}
+
+class CountingRequester : public DirectRequester {
+public:
+    std::atomic<int> calls_ = 0;
+
+    explicit CountingRequester(WSProviderServiceHost *delegate) : DirectRequester(delegate) {}
+
+    absl::StatusOr<std::string> MakeRequest(gp::Arena *arena, void *context,
+        const std::span<char> &data, bool json, std::string_view service,
+        std::string_view method) override {
+        calls_++;
+        return DirectRequester::MakeRequest(arena, context, data, json, service, method);
+    }
+};
+
+TEST(RpcTests, response_cache) {
+    auto impl = std::make_shared<SimpleImpl>();
+    WSProviderServiceHost host(impl);
+
+    auto dr = std::make_shared<CountingRequester>(&host);
+    WSProviderClient cli(dr, false, trpc::ResponseCache::make());
+
+    auto arena = google::protobuf::Arena();
+    auto req = gp::Arena::CreateMessage<WeatherStationId>(&arena);
+    req->set_id("Cached");
+    for (int i = 0; i < 3; i++) {
+        auto res = cli.FindWeatherStation(&arena, nullptr, req);
+        ASSERT_EQ(true, res.ok());
+        EXPECT_EQ("ReflectedCached", res.value()->ws_id().id());
+    }
+    // FindWeatherStation has no side effects, so only the first call reaches the server
+    EXPECT_EQ(1, dr->calls_);
+
+    // A different request is a cache miss
+    req->set_id("Other");
+    EXPECT_EQ(true, cli.FindWeatherStation(&arena, nullptr, req).ok());
+    EXPECT_EQ(2, dr->calls_);
+
+    // Errors are not cached
+    req->set_id("InjectError");
+    EXPECT_EQ(false, cli.FindWeatherStation(&arena, nullptr, req).ok());
+    EXPECT_EQ(false, cli.FindWeatherStation(&arena, nullptr, req).ok());
+    EXPECT_EQ(4, dr->calls_);
+
+    // Methods with side effects are never cached
+    EXPECT_EQ(false, cli.DeleteWeatherStation(&arena, nullptr, req).ok());
+    EXPECT_EQ(false, cli.DeleteWeatherStation(&arena, nullptr, req).ok());
+    EXPECT_EQ(6, dr->calls_);
+}
+
+TEST(RpcTests, response_cache_scope) {
+    auto impl = std::make_shared<SimpleImpl>();
+    WSProviderServiceHost host(impl);
+
+    // The client context is the caller name here
+    trpc::ResponseCacheOptions options;
+    options.scope_ = [](void *context) { return *static_cast<std::string*>(context); };
+    auto dr = std::make_shared<CountingRequester>(&host);
+    WSProviderClient cli(dr, false, trpc::ResponseCache::make(options));
+
+    WeatherStationId req;
+    req.set_id("Scoped");
+    std::string alice = "alice", bob = "bob";
+    for (int i = 0; i < 2; i++) {
+        EXPECT_EQ(true, cli.FindWeatherStation(nullptr, &alice, &req).ok());
+        EXPECT_EQ(true, cli.FindWeatherStation(nullptr, &bob, &req).ok());
+    }
+    // The responses are not shared between the callers
+    EXPECT_EQ(2, dr->calls_);
+}
+
+TEST(RpcTests, response_cache_throwing_fetch) {
+    auto cache = trpc::ResponseCache::make();
+    char request[] = "req";
+    std::span<const char> body(request, 3);
+
+    EXPECT_THROW(cache->GetOrFetch(nullptr, "svc", "method", false, body,
+        []() -> absl::StatusOr<std::string> { throw std::runtime_error("fetch failed"); }), std::runtime_error);
+
+    // The failed call is completed, so the next caller doesn't wait for it forever
+    auto res = cache->GetOrFetch(nullptr, "svc", "method", false, body,
+        []() -> absl::StatusOr<std::string> { return std::string("resp"); });
+    ASSERT_EQ(true, res.ok());
+    EXPECT_EQ("resp", *res.value());
+}
+
+TEST(RpcTests, latency_histogram) {
+    trpc::LatencyHistogram empty;
+    EXPECT_EQ(absl::ZeroDuration(), empty.Percentile(50));
+
+    // The small values are recorded exactly
+    trpc::LatencyHistogram small;
+    for (int i = 1; i <= 100; i++) {
+        small.Record(absl::Microseconds(i));
+    }
+    EXPECT_EQ(absl::Microseconds(50), small.Percentile(50));
+    EXPECT_EQ(absl::Microseconds(100), small.Percentile(100));
+    EXPECT_EQ(absl::Microseconds(50), small.Mean());
+
+    // The larger ones are within the histogram precision and never below the actual value
+    trpc::LatencyHistogram hist;
+    for (int i = 101; i <= 1000; i++) {
+        hist.Record(absl::Microseconds(i));
+    }
+    hist.Merge(small);
+    EXPECT_EQ(1000, hist.Count());
+    EXPECT_EQ(absl::Milliseconds(1), hist.Max());
+    EXPECT_GE(hist.Percentile(50), absl::Microseconds(500));
+    EXPECT_LE(hist.Percentile(50), absl::Microseconds(510));
+    EXPECT_GE(hist.Percentile(99), absl::Microseconds(990));
+    EXPECT_LE(hist.Percentile(99), absl::Microseconds(1000));
+    EXPECT_EQ(absl::Milliseconds(1), hist.Percentile(100));
+}
+
+TEST(RpcTests, load_corpus) {
+    auto dir = std::filesystem::temp_directory_path();
+    auto jsonPath = (dir / "twirp-corpus.json").string();
+    auto textPath = (dir / "twirp-corpus.txt").string();
+
+    std::ofstream(jsonPath) << "{\"id\": \"first\"}\n\n{\"id\": \"second\"}\n";
+    auto json = trpc::LoadCorpus<WeatherStationId>(jsonPath, trpc::CorpusFormat::kJson);
+    ASSERT_EQ(true, json.ok());
+    ASSERT_EQ(2, json.value().size());
+    EXPECT_EQ("first", json.value()[0].id());
+    EXPECT_EQ("second", json.value()[1].id());
+
+    std::ofstream(textPath) << "id: \"first\"\n---\nid: \"second\"\n";
+    auto text = trpc::LoadCorpus<WeatherStationId>(textPath, trpc::CorpusFormat::kText);
+    ASSERT_EQ(true, text.ok());
+    ASSERT_EQ(2, text.value().size());
+    EXPECT_EQ("second", text.value()[1].id());
+
+    // Malformed records are reported with their number
+    std::ofstream(jsonPath) << "{\"id\": \"first\"}\n{\"id\": 12\n";
+    auto bad = trpc::LoadCorpus<WeatherStationId>(jsonPath, trpc::CorpusFormat::kJson);
+    EXPECT_EQ(true, absl::IsInvalidArgument(bad.status()));
+    EXPECT_EQ("Can't parse the corpus record #1", bad.status().message());
+
+    std::ofstream(jsonPath) << "\n";
+    EXPECT_EQ(true, absl::IsInvalidArgument(
+        trpc::LoadCorpus<WeatherStationId>(jsonPath, trpc::CorpusFormat::kJson).status()));
+
+    std::filesystem::remove(jsonPath);
+    std::filesystem::remove(textPath);
+    EXPECT_EQ(true, absl::IsNotFound(
+        trpc::LoadCorpus<WeatherStationId>(jsonPath, trpc::CorpusFormat::kJson).status()));
+}
+
+TEST(RpcTests, load_error_codes) {
+    EXPECT_EQ("ok", trpc::TwirpErrorCode(absl::OkStatus()));
+
+    // The errors returned by the server are labelled with their Twirp code
+    absl::Status server = absl::ResourceExhaustedError("Slow down");
+    trpc::MarkServerError(server);
+    EXPECT_EQ("resource_exhausted", trpc::TwirpErrorCode(server));
+
+    // The client-side failures are kept apart
+    EXPECT_EQ("client:unavailable", trpc::TwirpErrorCode(absl::UnavailableError("Connection refused")));
+}
+
+TEST(RpcTests, body_builder_reserve) {
+    trpc::SpillOptions spill;
+    spill.threshold_ = 256 * 1024;
+    trpc::MessageBodyBuilder builder(spill);
+
+    // The declared size only reserves a small buffer, the file is created when the data arrives
+    ASSERT_TRUE(builder.Reserve(size_t(1) << 30).ok());
+    std::string chunk(64 * 1024, 'z');
+    for (int i = 0; i < 8; i++) {
+        ASSERT_TRUE(builder.Append(chunk.data(), chunk.size()).ok());
+    }
+    trpc::MessageBody body = builder.Finish();
+    EXPECT_EQ(true, body.IsMapped());
+    EXPECT_EQ(8 * chunk.size(), body.size());
+    EXPECT_GE(spill.threshold_ * 2, body.Mapped()->capacity());
+
+    trpc::MessageBodyBuilder small(trpc::SpillOptions{});
+    ASSERT_TRUE(small.Reserve(size_t(1) << 30).ok());
+    trpc::MessageBody empty = small.Finish();
+    EXPECT_GE(size_t(64 * 1024), empty.Heap().capacity());
+}
+
+TEST(RpcTests, serialize_spilled) {
+    trpc::SpillOptions spill;
+    spill.threshold_ = 1024;
+    WeatherStation station;
+    station.set_contextdata(std::string(4096, 'q'));
+
+    auto body = trpc::SerializeMessageBody(&station, false, spill);
+    ASSERT_TRUE(body.ok()) << body.status();
+    EXPECT_EQ(true, body.value().IsMapped());
+    EXPECT_EQ(station.ByteSizeLong(), body.value().MutableSpan().size());
+
+    auto res = trpc::DeserializeMessage<WeatherStation>(nullptr, body.value().Span(), false);
+    ASSERT_TRUE(res.ok()) << res.status();
+    EXPECT_EQ(station.contextdata(), res.value()->contextdata());
+
+    // JSON is always serialized on the heap
+    auto json = trpc::SerializeMessageBody(&station, true, spill);
+    ASSERT_TRUE(json.ok()) << json.status();
+    EXPECT_EQ(false, json.value().IsMapped());
+}
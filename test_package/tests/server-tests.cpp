@@ -0,0 +1,734 @@
+#include <gtest/gtest.h>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <twirp/httplib/server-helper.h>
+#include <twirp/httplib/client-helper.h>
+#include <twirp/replay.h>
+#include <filesystem>
+#include <fstream>
+#include "service1_server.hpp"
+#include "service1_client.hpp"
+
+using namespace weather;
+
+class EchoImpl : public WSProviderService {
+public:
+    absl::StatusOr<WeatherStation*> FindWeatherStation(gp::Arena *arena, trpc::RequestContext *context,
+        const WeatherStationId *req) override {
+        trpc::OwnedPtr<WeatherStation> res(gp::Arena::CreateMessage<WeatherStation>(arena));
+        res->mutable_ws_id()->set_id(req->id());
+        if (req->id() == "Large") {
+            res->set_contextdata(std::string(1024 * 1024, 'x'));
+        }
+        return res.release();
+    };
+
+    absl::StatusOr<weather::WeatherStation *> DeleteWeatherStation(
+        gp::Arena *arena, trpc::RequestContext *context,
+        const weather::WeatherStationId *req) override {
+        return absl::UnimplementedError("");
+    }
+
+    absl::StatusOr<weather::WeatherStationId *> UpdateWeatherStation(
+        gp::Arena *arena, trpc::RequestContext *context,
+        const weather::WeatherStation *req) override {
+        trpc::OwnedPtr<WeatherStationId> res(gp::Arena::CreateMessage<WeatherStationId>(arena));
+        res->set_id(std::to_string(req->contextdata().size()));
+        return res.release();
+    }
+};
+
+// Runs the Twirp server on a random local port for the duration of a test
+class TestServer {
+    httplib::Server srv_;
+    WSProviderServiceHost host_;
+    std::thread thread_;
+    int port_;
+public:
+    explicit TestServer(const trpc::ServerOptions &options,
+        const trpc::ServerMiddlewares &middlewares = trpc::ServerMiddlewares()) : host_(std::make_shared<EchoImpl>()) {
+        if (options.limiter_) {
+            trpc::InstallLimiterThreadPool(&srv_);
+        }
+        trpc::RegisterTwirpHandlers(&host_, &srv_, middlewares, options);
+        port_ = srv_.bind_to_any_port("127.0.0.1");
+        thread_ = std::thread([this]() { srv_.listen_after_bind(); });
+    }
+
+    ~TestServer() {
+        srv_.stop();
+        thread_.join();
+    }
+
+    std::string Url() const {
+        return "http://127.0.0.1:" + std::to_string(port_);
+    }
+};
+
+void test_request_size_limit(bool json) {
+    trpc::ServerOptions options;
+    options.methodMaxRequestSize_["FindWeatherStation"] = 64;
+    TestServer server(options);
+
+    WSProviderClient cli(std::make_shared<trpc::HttplibRequester>(server.Url()), json);
+
+    WeatherStationId req;
+    req.set_id("Small");
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(res.ok()) << res.status();
+    EXPECT_EQ("Small", res.value()->ws_id().id());
+    delete res.value();
+
+    req.set_id(std::string(100, 'x'));
+    res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    EXPECT_FALSE(res.ok());
+    EXPECT_TRUE(absl::IsOutOfRange(res.status()));
+}
+
+TEST(ServerTests, request_size_limit_protobuf) {
+    test_request_size_limit(false);
+}
+
+TEST(ServerTests, request_size_limit_json) {
+    test_request_size_limit(true);
+}
+
+// Rejects the requests that mention the forbidden word anywhere in their body
+class BodyFilterMiddleware : public trpc::ServerMiddleware {
+public:
+    absl::Status HandleWithBody(gp::Arena *arena, trpc::RequestContext *ctx, bool json,
+        const httplib::Request &request, std::span<const char> body, httplib::Response &response) override {
+        if (std::string_view(body.data(), body.size()).find("Forbidden") != std::string_view::npos) {
+            return absl::PermissionDeniedError("Forbidden word");
+        }
+        return absl::OkStatus();
+    }
+};
+
+TEST(ServerTests, middleware_body) {
+    TestServer server(trpc::ServerOptions(), trpc::ServerMiddlewares{std::make_shared<BodyFilterMiddleware>()});
+    WSProviderClient cli(std::make_shared<trpc::HttplibRequester>(server.Url()), false);
+
+    WeatherStationId req;
+    req.set_id("Allowed");
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(res.ok()) << res.status();
+    delete res.value();
+
+    req.set_id("Forbidden");
+    res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    EXPECT_TRUE(absl::IsPermissionDenied(res.status()));
+}
+
+TEST(ServerTests, tracing) {
+    trpc::ServerOptions options;
+    // Sample only the requests with the incoming trace ID
+    options.tracer_ = trpc::Tracer::make(UINT32_MAX);
+    options.trustTraceIds_ = true;
+    TestServer server(options);
+
+    auto clientTracer = trpc::Tracer::make(1);
+    auto requester = std::make_shared<trpc::HttplibRequester>(server.Url());
+    requester->SetTracer(clientTracer);
+    WSProviderClient cli(requester, false);
+
+    WeatherStationId req;
+    req.set_id("Traced");
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(res.ok()) << res.status();
+    delete res.value();
+
+    auto clientEvents = clientTracer->Collect();
+    ASSERT_EQ(1, clientEvents.size());
+    EXPECT_EQ(trpc::TracePhase::kClient, clientEvents[0].phase_);
+    EXPECT_EQ("FindWeatherStation", clientEvents[0].label_);
+    uint64_t traceId = clientEvents[0].traceId_;
+
+    std::set<trpc::TracePhase> phases;
+    for (const auto &ev : options.tracer_->Collect()) {
+        EXPECT_EQ(traceId, ev.traceId_);
+        EXPECT_LE(ev.startNs_, ev.endNs_);
+        phases.insert(ev.phase_);
+    }
+    for (auto phase : {trpc::TracePhase::kRequest, trpc::TracePhase::kReadBody, trpc::TracePhase::kDecode,
+        trpc::TracePhase::kValidate, trpc::TracePhase::kHandler, trpc::TracePhase::kEncode}) {
+        EXPECT_TRUE(phases.contains(phase)) << trpc::TracePhaseName(phase);
+    }
+
+    // The events are flushed only once
+    std::stringstream out;
+    clientTracer->Flush(out, 1);
+    EXPECT_EQ("{\"traceEvents\":[\n]}\n", out.str());
+}
+
+TEST(ServerTests, tracing_untrusted_ids) {
+    trpc::ServerOptions options;
+    options.tracer_ = trpc::Tracer::make(UINT32_MAX);
+    TestServer server(options);
+
+    auto requester = std::make_shared<trpc::HttplibRequester>(server.Url());
+    requester->SetTracer(trpc::Tracer::make(1));
+    WSProviderClient cli(requester, false);
+
+    // The incoming trace IDs are ignored by default, so the callers can't force the tracing
+    WeatherStationId req;
+    req.set_id("Traced");
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(res.ok()) << res.status();
+    delete res.value();
+    EXPECT_TRUE(options.tracer_->Collect().empty());
+}
+
+TEST(ServerTests, tracing_sampling_and_flush) {
+    // Each tracer counts its own requests
+    auto everyOther = trpc::Tracer::make(2);
+    auto everyThird = trpc::Tracer::make(3);
+    int sampled[2] = {0, 0};
+    for (int i = 0; i < 12; i++) {
+        sampled[0] += everyOther->Sample() != 0;
+        sampled[1] += everyThird->Sample() != 0;
+    }
+    EXPECT_EQ(6, sampled[0]);
+    EXPECT_EQ(4, sampled[1]);
+
+    // The labels are escaped in the JSON output
+    everyOther->Collect();
+    everyOther->Record(0x1F, trpc::TracePhase::kHandler, 1000, 3000, "quote\"back\\slash\n");
+    std::stringstream out;
+    everyOther->Flush(out, 1);
+    EXPECT_NE(std::string::npos, out.str().find(
+        "\"name\":\"handler quote\\\"back\\\\slash\\u000a\""));
+}
+
+TEST(ServerTests, concurrency_limiter_priorities) {
+    trpc::ConcurrencyLimiterOptions limiterOptions;
+    limiterOptions.initialLimit_ = 10;
+    auto limiter = trpc::ConcurrencyLimiter::make(limiterOptions);
+
+    // The low-priority requests get 50% of the limit, the normal ones get 80%
+    std::vector<trpc::ConcurrencyPermit> permits;
+    for (int i = 0; i < 5; i++) {
+        auto permit = limiter->Acquire(trpc::Priority::kNormal);
+        ASSERT_TRUE(permit.ok());
+        permits.push_back(std::move(permit.value()));
+    }
+    auto low = limiter->Acquire(trpc::Priority::kLow);
+    EXPECT_TRUE(absl::IsResourceExhausted(low.status()));
+
+    for (int i = 0; i < 3; i++) {
+        auto permit = limiter->Acquire(trpc::Priority::kNormal);
+        ASSERT_TRUE(permit.ok());
+        permits.push_back(std::move(permit.value()));
+    }
+    EXPECT_FALSE(limiter->Acquire(trpc::Priority::kNormal).ok());
+
+    // The high-priority requests can still use the rest of the limit
+    auto high = limiter->Acquire(trpc::Priority::kHigh);
+    EXPECT_TRUE(high.ok());
+    EXPECT_EQ(9, limiter->InFlight());
+
+    // The dropped requests shrink the limit
+    for (auto &permit : permits) {
+        permit.SetDropped();
+    }
+    permits.clear();
+    EXPECT_EQ(1, limiter->InFlight());
+    EXPECT_LT(limiter->Limit(), 10);
+}
+
+// Holds the requests after their admission until the gate is opened
+class GateMiddleware : public trpc::ServerMiddleware {
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    int entered_ = 0;
+    bool open_ = false;
+public:
+    absl::Status Handle(gp::Arena *arena, trpc::RequestContext *ctx, bool json,
+        const httplib::Request &request, httplib::Response &response) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        entered_++;
+        changed_.notify_all();
+        changed_.wait(lock, [this]() { return open_; });
+        return absl::OkStatus();
+    }
+
+    int Entered() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entered_;
+    }
+
+    void Open() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        open_ = true;
+        changed_.notify_all();
+    }
+};
+
+TEST(ServerTests, server_error_marking) {
+    TestServer server{trpc::ServerOptions()};
+    auto requester = std::make_shared<trpc::HttplibRequester>(server.Url());
+    WSProviderClient cli(requester, false);
+    WeatherStationId req;
+    req.set_id(std::string(300, 'a'));
+
+    // The errors keep only the metadata sent by the server by default
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(absl::IsInvalidArgument(res.status()));
+    EXPECT_FALSE(res.status().GetPayload(trpc::TwirpStatusKey).has_value());
+    EXPECT_EQ("client:invalid_argument", trpc::TwirpErrorCode(res.status()));
+
+    requester->SetMarkServerErrors(true);
+    res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    EXPECT_EQ("invalid_argument", trpc::TwirpErrorCode(res.status()));
+}
+
+TEST(ServerTests, limiter_thread_pool) {
+    trpc::LimiterThreadPoolOptions poolOptions;
+    poolOptions.maxThreads_ = 3;
+    poolOptions.idleTimeout_ = absl::Milliseconds(50);
+    trpc::LimiterThreadPool pool(poolOptions);
+
+    std::mutex mutex;
+    int running = 0, maxRunning = 0, done = 0;
+    for (int i = 0; i < 10; i++) {
+        pool.enqueue([&]() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                maxRunning = std::max(maxRunning, ++running);
+            }
+            absl::SleepFor(absl::Milliseconds(10));
+            std::lock_guard<std::mutex> lock(mutex);
+            running--;
+            done++;
+        });
+    }
+    EXPECT_GE(size_t(3), pool.Threads());
+
+    // The idle workers exit
+    absl::Time deadline = absl::Now() + absl::Seconds(10);
+    while (pool.Threads() != 0 && absl::Now() < deadline) {
+        absl::SleepFor(absl::Milliseconds(5));
+    }
+    EXPECT_EQ(0, pool.Threads());
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        EXPECT_EQ(10, done);
+        EXPECT_EQ(3, maxRunning);
+    }
+
+    // And new ones are started for the new tasks
+    std::atomic<bool> ran = false;
+    pool.enqueue([&]() { ran = true; });
+    pool.shutdown();
+    EXPECT_TRUE(ran);
+}
+
+TEST(ServerTests, concurrency_limiter_sheds) {
+    trpc::ConcurrencyLimiterOptions limiterOptions;
+    limiterOptions.initialLimit_ = 4;
+    limiterOptions.maxLimit_ = 4;
+    trpc::ServerOptions options;
+    options.limiter_ = trpc::ConcurrencyLimiter::make(limiterOptions);
+    auto gate = std::make_shared<GateMiddleware>();
+    TestServer server(options, trpc::ServerMiddlewares{gate});
+
+    // More concurrent requests than the limit and the default httplib worker pool. The requests over
+    // the limit must be rejected, not queued behind the admitted ones.
+    constexpr int Requests = 12;
+    std::atomic<int> succeeded = 0, shed = 0;
+    std::vector<std::thread> clients;
+    for (int i = 0; i < Requests; i++) {
+        clients.emplace_back([&]() {
+            WSProviderClient cli(std::make_shared<trpc::HttplibRequester>(server.Url()), false);
+            WeatherStationId req;
+            req.set_id("Gated");
+            auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+            if (res.ok()) {
+                succeeded++;
+                delete res.value();
+            } else if (absl::IsResourceExhausted(res.status())) {
+                shed++;
+            }
+        });
+    }
+
+    absl::Time deadline = absl::Now() + absl::Seconds(10);
+    while ((gate->Entered() < 4 || shed < Requests - 4) && absl::Now() < deadline) {
+        absl::SleepFor(absl::Milliseconds(1));
+    }
+    EXPECT_EQ(4, gate->Entered());
+    EXPECT_EQ(4, options.limiter_->InFlight());
+    gate->Open();
+    for (auto &t : clients) {
+        t.join();
+    }
+    EXPECT_EQ(4, succeeded);
+    EXPECT_EQ(Requests - 4, shed);
+}
+
+TEST(ServerTests, method_priorities) {
+    WSProviderServiceHost host(std::make_shared<EchoImpl>());
+    trpc::ServerOptions options;
+    EXPECT_EQ(trpc::Priority::kHigh, options.GetPriority(&host, "FindWeatherStation"));
+    EXPECT_EQ(trpc::Priority::kLow, options.GetPriority(&host, "DeleteWeatherStation"));
+    EXPECT_EQ(trpc::Priority::kNormal, options.GetPriority(&host, "UpdateWeatherStation"));
+
+    // The registration-time settings override the proto options
+    options.methodPriority_["DeleteWeatherStation"] = trpc::Priority::kHigh;
+    EXPECT_EQ(trpc::Priority::kHigh, options.GetPriority(&host, "DeleteWeatherStation"));
+}
+
+// The request context key for the rate-limiting test
+struct TenantKey {
+    typedef std::string ValueType;
+    static constexpr std::string_view Name = "Tenant";
+    static const std::string& Default() {
+        static std::string def;
+        return def;
+    }
+};
+
+class TenantMiddleware : public trpc::ServerMiddleware {
+public:
+    absl::Status Handle(gp::Arena *arena, trpc::RequestContext *ctx, bool json,
+        const httplib::Request &request, httplib::Response &response) override {
+        ctx->Set<TenantKey>(request.get_header_value("X-Tenant"));
+        return absl::OkStatus();
+    }
+};
+
+TEST(ServerTests, rate_limit) {
+    trpc::RateLimiterOptions limits;
+    limits.rate_ = 0.1;
+    limits.burst_ = 2;
+    TestServer server(trpc::ServerOptions(), trpc::ServerMiddlewares{
+        std::make_shared<TenantMiddleware>(),
+        trpc::RateLimitMiddleware<TenantKey>::make(limits, [](const std::string &tenant) {
+            return std::string_view(tenant);
+        }),
+    });
+
+    auto makeClient = [&](const std::string &tenant) {
+        trpc::ClientMiddlewares middlewares{trpc::SetHeaderMiddleware::make("X-Tenant", std::string(tenant))};
+        return WSProviderClient(std::make_shared<trpc::HttplibRequester>(server.Url(), std::move(middlewares)), false);
+    };
+    WSProviderClient first = makeClient("first");
+    WSProviderClient second = makeClient("second");
+    WSProviderClient anonymous = makeClient("");
+
+    WeatherStationId req;
+    req.set_id("Limited");
+    for (int i = 0; i < 2; i++) {
+        auto res = first.FindWeatherStation(nullptr, nullptr, &req);
+        ASSERT_TRUE(res.ok()) << res.status();
+        delete res.value();
+    }
+
+    // The burst is exhausted, the next token is available in ~10 seconds
+    auto res = first.FindWeatherStation(nullptr, nullptr, &req);
+    EXPECT_TRUE(absl::IsResourceExhausted(res.status()));
+    auto retryAfter = res.status().GetPayload(trpc::RetryAfterKey);
+    ASSERT_TRUE(retryAfter.has_value());
+    EXPECT_GT(std::stoi(std::string(retryAfter.value().Flatten())), 9000);
+
+    // Other tenants have their own buckets, and the empty key is not limited
+    for (int i = 0; i < 3; i++) {
+        auto otherRes = (i < 2 ? second : anonymous).FindWeatherStation(nullptr, nullptr, &req);
+        ASSERT_TRUE(otherRes.ok()) << otherRes.status();
+        delete otherRes.value();
+    }
+}
+
+TEST(ServerTests, rate_limiter_probing) {
+    trpc::RateLimiterOptions limits;
+    limits.rate_ = 1;
+    limits.burst_ = 1;
+    limits.shards_ = 1;
+    limits.slotsPerShard_ = 4;
+    limits.idleTimeout_ = absl::ZeroDuration();
+    trpc::RateLimiter limiter(limits);
+
+    // Both keys start probing at the first slot, so the second one lands in the next slot
+    absl::Duration retryAfter;
+    ASSERT_TRUE(limiter.TryAcquire(uint64_t(4), &retryAfter));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1400));
+    ASSERT_TRUE(limiter.TryAcquire(uint64_t(8), &retryAfter));
+
+    // The first slot is idle now, but the second key must still find its own exhausted bucket
+    std::this_thread::sleep_for(std::chrono::milliseconds(800));
+    EXPECT_FALSE(limiter.TryAcquire(uint64_t(8), &retryAfter));
+
+    // A zero rate disables the limit
+    trpc::RateLimiterOptions unlimited;
+    unlimited.rate_ = 0;
+    trpc::RateLimiter unlimitedLimiter(unlimited);
+    for (int i = 0; i < 1000; i++) {
+        ASSERT_TRUE(unlimitedLimiter.TryAcquire(std::string_view("key"), &retryAfter));
+    }
+}
+
+TEST(ServerTests, body_builder_spills) {
+    trpc::SpillOptions spill;
+    spill.threshold_ = 100;
+
+    trpc::MessageBodyBuilder small(spill);
+    ASSERT_TRUE(small.Append("hello", 5).ok());
+    trpc::MessageBody smallBody = small.Finish();
+    EXPECT_FALSE(smallBody.IsMapped());
+    EXPECT_EQ("hello", std::string(smallBody.Span().data(), smallBody.size()));
+
+    // The body grows past the threshold and then past the initial mapping size
+    std::string expected;
+    trpc::MessageBodyBuilder large(spill);
+    for (int i = 0; i < 100; i++) {
+        std::string chunk = std::to_string(i) + ",";
+        expected += chunk;
+        ASSERT_TRUE(large.Append(chunk.data(), chunk.size()).ok());
+    }
+    trpc::MessageBody largeBody = large.Finish();
+    EXPECT_TRUE(largeBody.IsMapped());
+    EXPECT_EQ(expected, std::string(largeBody.Span().data(), largeBody.size()));
+}
+
+void test_large_bodies(bool json) {
+    trpc::SpillOptions spill;
+    spill.threshold_ = 4096;
+    trpc::ServerOptions options;
+    options.spill_ = spill;
+    TestServer server(options);
+
+    auto requester = std::make_shared<trpc::HttplibRequester>(server.Url());
+    requester->SetSpillOptions(spill);
+    WSProviderClient cli(requester, json);
+
+    // The large request is spilled on the server
+    WeatherStation station;
+    station.set_contextdata(std::string(1024 * 1024, 'y'));
+    auto updRes = cli.UpdateWeatherStation(nullptr, nullptr, &station);
+    ASSERT_TRUE(updRes.ok()) << updRes.status();
+    EXPECT_EQ("1048576", updRes.value()->id());
+    delete updRes.value();
+
+    // The large response is spilled on both sides
+    WeatherStationId req;
+    req.set_id("Large");
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(res.ok()) << res.status();
+    EXPECT_EQ(std::string(1024 * 1024, 'x'), res.value()->contextdata());
+    delete res.value();
+
+    // The errors are still decoded
+    req.set_id(std::string(300, 'a'));
+    res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    EXPECT_TRUE(absl::IsInvalidArgument(res.status()));
+    EXPECT_TRUE(res.status().GetPayload("violation.id").has_value());
+}
+
+TEST(ServerTests, large_bodies_protobuf) {
+    test_large_bodies(false);
+}
+
+TEST(ServerTests, large_bodies_json) {
+    test_large_bodies(true);
+}
+
+TEST(ServerTests, capture_replay) {
+    std::string path = (std::filesystem::temp_directory_path() / "twirp-capture-test.bin").string();
+    {
+        trpc::CaptureOptions captureOptions;
+        captureOptions.capacity_ = 1024 * 1024;
+        trpc::ServerOptions options;
+        options.capture_ = trpc::CaptureLog::Create(path, captureOptions).value();
+        TestServer server(options, trpc::ServerMiddlewares{std::make_shared<TenantMiddleware>()});
+
+        trpc::ClientMiddlewares middlewares{trpc::SetHeaderMiddleware::make("X-Tenant", "alpha")};
+        auto requester = std::make_shared<trpc::HttplibRequester>(server.Url(), std::move(middlewares));
+        WSProviderClient protoCli(requester, false);
+        WSProviderClient jsonCli(requester, true);
+
+        WeatherStationId req;
+        for (int i = 0; i < 10; i++) {
+            req.set_id("Station" + std::to_string(i));
+            auto res = (i % 2 ? jsonCli : protoCli).FindWeatherStation(nullptr, nullptr, &req);
+            ASSERT_TRUE(res.ok()) << res.status();
+            delete res.value();
+        }
+        EXPECT_EQ(0, options.capture_->Dropped());
+        // The log is truncated to its used size once the server releases it
+    }
+
+    auto reader = trpc::CaptureReader::Open(path);
+    ASSERT_TRUE(reader.ok()) << reader.status();
+    const auto &records = reader.value()->Records();
+    ASSERT_EQ(10, records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        EXPECT_EQ("weather.WSProvider", records[i].service_);
+        EXPECT_EQ("FindWeatherStation", records[i].method_);
+        EXPECT_EQ(i % 2 == 1, records[i].json_);
+        ASSERT_EQ(1, records[i].context_.size());
+        EXPECT_EQ(TenantKey::Name, records[i].context_[0].first);
+        EXPECT_EQ("alpha", records[i].context_[0].second);
+        if (i > 0) {
+            EXPECT_LE(records[i - 1].received_, records[i].received_);
+        }
+    }
+
+    // Replay in-process
+    WSProviderServiceHost host(std::make_shared<EchoImpl>());
+    trpc::ReplayOptions replayOptions;
+    replayOptions.speed_ = 0;
+    trpc::ReplayReport inProcess = trpc::RunReplay(records, replayOptions, [&](size_t) {
+        return trpc::MakeInProcessReplay({&host}, [](const trpc::CaptureRecord &rec, trpc::RequestContext *ctx) {
+            ctx->Set<TenantKey>(std::string(rec.context_[0].second));
+        });
+    });
+    ASSERT_EQ(1, inProcess.byRoute_.size());
+    EXPECT_EQ(10, inProcess.byRoute_["weather.WSProvider/FindWeatherStation"].Count());
+    EXPECT_TRUE(inProcess.errors_.empty());
+
+    // Replay over HTTP at the scaled timing, then compare with the in-process run
+    TestServer server{trpc::ServerOptions()};
+    replayOptions.speed_ = 10;
+    trpc::ReplayReport overHttp = trpc::RunReplay(records, replayOptions, [&](size_t) {
+        return trpc::MakeRequesterReplay(std::make_shared<trpc::HttplibRequester>(server.Url()));
+    });
+    EXPECT_EQ(10, overHttp.byRoute_["weather.WSProvider/FindWeatherStation"].Count());
+    EXPECT_TRUE(overHttp.errors_.empty());
+
+    std::stringstream saved;
+    trpc::SaveReplaySummary(inProcess.Summarize(), saved);
+    auto baseline = trpc::LoadReplaySummary(saved);
+    ASSERT_TRUE(baseline.ok()) << baseline.status();
+    EXPECT_EQ(10, baseline.value()["weather.WSProvider/FindWeatherStation"].count_);
+
+    std::stringstream diff;
+    trpc::PrintReplayDiff(baseline.value(), overHttp.Summarize(), diff);
+    EXPECT_NE(std::string::npos, diff.str().find("weather.WSProvider/FindWeatherStation: p50="));
+
+    std::filesystem::remove(path);
+}
+
+TEST(ServerTests, capture_uncommitted_records) {
+    std::string path = (std::filesystem::temp_directory_path() / "twirp-capture-uncommitted.bin").string();
+    {
+        trpc::CaptureOptions captureOptions;
+        captureOptions.capacity_ = 4096;
+        auto log = trpc::CaptureLog::Create(path, captureOptions).value();
+        trpc::RequestContext ctx;
+        for (int i = 0; i < 3; i++) {
+            log->Append(absl::FromUnixSeconds(i), "s", "m", false, ctx, std::span<const char>("abcdef", 6));
+        }
+    }
+    EXPECT_EQ(std::filesystem::perms::owner_read | std::filesystem::perms::owner_write,
+        std::filesystem::status(path).permissions());
+
+    // Each record is 40 bytes: the 32-byte header, the names and the body
+    auto patch = [&](std::streamoff offset, auto value) {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(offset);
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    const std::streamoff second = trpc::CaptureLogHeader::DataOffset + 40;
+
+    // A reserved record with a known size is skipped, the records after it are still read
+    patch(second + offsetof(trpc::CaptureRecordHeader, committed_), uint32_t(0));
+    // The space reserved past the last committed record is not an error
+    patch(offsetof(trpc::CaptureLogHeader, tail_), uint64_t(160));
+    std::filesystem::resize_file(path, trpc::CaptureLogHeader::DataOffset + 160);
+    {
+        auto reader = trpc::CaptureReader::Open(path);
+        ASSERT_TRUE(reader.ok()) << reader.status();
+        ASSERT_EQ(2, reader.value()->Records().size());
+        EXPECT_EQ(absl::FromUnixSeconds(2), reader.value()->Records()[1].received_);
+    }
+
+    // The committed record after a record without its size can't be found
+    patch(second + offsetof(trpc::CaptureRecordHeader, size_), uint32_t(0));
+    EXPECT_TRUE(absl::IsDataLoss(trpc::CaptureReader::Open(path).status()));
+
+    // The parts that don't fit into the record are detected before reading them
+    patch(second + offsetof(trpc::CaptureRecordHeader, size_), uint32_t(40));
+    patch(second + offsetof(trpc::CaptureRecordHeader, committed_), uint32_t(1));
+    patch(second + offsetof(trpc::CaptureRecordHeader, bodySize_), UINT32_MAX);
+    EXPECT_TRUE(absl::IsDataLoss(trpc::CaptureReader::Open(path).status()));
+    patch(second + offsetof(trpc::CaptureRecordHeader, bodySize_), uint32_t(6));
+    patch(second + offsetof(trpc::CaptureRecordHeader, contextSize_), uint32_t(8));
+    EXPECT_TRUE(absl::IsDataLoss(trpc::CaptureReader::Open(path).status()));
+
+    std::filesystem::remove(path);
+}
+
+TEST(ServerTests, capture_sampling) {
+    auto dir = std::filesystem::temp_directory_path();
+    trpc::CaptureOptions captureOptions;
+    captureOptions.capacity_ = 4096;
+    captureOptions.sampleEvery_ = 2;
+    auto first = trpc::CaptureLog::Create((dir / "twirp-capture-first.bin").string(), captureOptions).value();
+    auto second = trpc::CaptureLog::Create((dir / "twirp-capture-second.bin").string(), captureOptions).value();
+
+    // Each log counts its own requests
+    int sampled[2] = {0, 0};
+    for (int i = 0; i < 10; i++) {
+        sampled[0] += first->Sample();
+        sampled[1] += second->Sample();
+    }
+    EXPECT_EQ(5, sampled[0]);
+    EXPECT_EQ(5, sampled[1]);
+
+    first.reset();
+    second.reset();
+    std::filesystem::remove(dir / "twirp-capture-first.bin");
+    std::filesystem::remove(dir / "twirp-capture-second.bin");
+}
+
+// A transport that counts the remote calls made through the HTTP requester
+class CountingTransport {
+    trpc::HttplibRequester requester_;
+public:
+    std::atomic<int> calls_ = 0;
+
+    explicit CountingTransport(const std::string &url) : requester_(url) {}
+
+    absl::StatusOr<trpc::MessageBody> MakeRoutedRequest(gp::Arena *arena, void *context, const std::span<char> &data,
+        bool json, const char *path, std::string_view service, std::string_view method) {
+        calls_++;
+        return requester_.MakeRoutedRequest(arena, context, data, json, path, service, method);
+    }
+};
+
+TEST(ServerTests, templated_client) {
+    static_assert(trpc::RequestTransport<trpc::HttplibRequester>);
+    static_assert(trpc::RequestTransport<CountingTransport>);
+    static_assert(std::string_view(WSProviderRoutes::FindWeatherStationPath) ==
+        "/twirp/weather.WSProvider/FindWeatherStation");
+
+    TestServer server{trpc::ServerOptions()};
+    auto cache = trpc::ResponseCache::make();
+    auto transport = std::make_shared<CountingTransport>(server.Url());
+    WSProviderClientT<CountingTransport> cli(transport, false, cache);
+
+    // The templated client is usable through the interface, e.g. in place of a mock
+    WSProviderClientInterface &iface = cli;
+    WeatherStationId req;
+    req.set_id("Templated");
+    for (int i = 0; i < 2; i++) {
+        // The second call is served from the cache
+        auto res = iface.FindWeatherStation(nullptr, nullptr, &req);
+        ASSERT_TRUE(res.ok()) << res.status();
+        EXPECT_EQ("Templated", res.value()->ws_id().id());
+        delete res.value();
+    }
+    EXPECT_EQ(1, transport->calls_);
+
+    WeatherStation station;
+    station.set_contextdata("12345");
+    auto updRes = cli.UpdateWeatherStation(nullptr, nullptr, &station);
+    ASSERT_TRUE(updRes.ok()) << updRes.status();
+    EXPECT_EQ("5", updRes.value()->id());
+    delete updRes.value();
+
+    // The errors are decoded the same way as in the virtual client
+    auto delRes = cli.DeleteWeatherStation(nullptr, nullptr, &req);
+    EXPECT_TRUE(absl::IsUnimplemented(delRes.status()));
+}
@@ -0,0 +1,266 @@
+#include <gtest/gtest.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <thread>
+#include <twirp/shm/server-helper.h>
+#include <twirp/shm/client-helper.h>
+#include "service1_server.hpp"
+#include "service1_client.hpp"
+
+using namespace weather;
+
+namespace {
+
+class ShmEchoImpl : public WSProviderService {
+public:
+    absl::StatusOr<WeatherStation*> FindWeatherStation(gp::Arena *arena, trpc::RequestContext *context,
+        const WeatherStationId *req) override {
+        trpc::OwnedPtr<WeatherStation> res(gp::Arena::CreateMessage<WeatherStation>(arena));
+        res->mutable_ws_id()->set_id(req->id());
+        return res.release();
+    };
+
+    absl::StatusOr<weather::WeatherStation *> DeleteWeatherStation(
+        gp::Arena *arena, trpc::RequestContext *context,
+        const weather::WeatherStationId *req) override {
+        auto res = absl::NotFoundError("No such station");
+        res.SetPayload("details", absl::Cord("a long explanation"));
+        return res;
+    }
+
+    absl::StatusOr<weather::WeatherStationId *> UpdateWeatherStation(
+        gp::Arena *arena, trpc::RequestContext *context,
+        const weather::WeatherStation *req) override {
+        return absl::UnimplementedError("");
+    }
+};
+
+// Runs the shared-memory server on a thread for the duration of a test
+class ShmTestServer {
+    WSProviderServiceHost host_;
+    std::unique_ptr<trpc::ShmServer> srv_;
+    std::thread thread_;
+public:
+    // serve - start serving the requests right away, otherwise `Start` does it
+    ShmTestServer(const std::string &name, size_t capacity, bool serve = true) :
+        host_(std::make_shared<ShmEchoImpl>()) {
+        // Replace the segment that might be left by a crashed test run
+        srv_ = std::move(trpc::ShmServer::make(name, capacity, true).value());
+        srv_->RegisterService(&host_);
+        if (serve) {
+            Start();
+        }
+    }
+
+    trpc::ShmServer &Get() {
+        return *srv_;
+    }
+
+    void Start() {
+        thread_ = std::thread([this]() { EXPECT_TRUE(srv_->Serve().ok()); });
+    }
+
+    ~ShmTestServer() {
+        Stop();
+    }
+
+    void Stop() {
+        if (thread_.joinable()) {
+            srv_->Stop();
+            thread_.join();
+        }
+    }
+};
+
+std::string SegmentName() {
+    return "/twirp-test-" + std::to_string(getpid());
+}
+
+// Write the request into the ring directly, bypassing the requester
+absl::Status WriteRawRequest(trpc::ShmRing &ring, uint64_t callId, std::string_view method, std::string_view body,
+    uint32_t bodySize) {
+    std::string_view service = "weather.WSProvider";
+    trpc::ShmRequestHeader header{callId, static_cast<uint32_t>(service.size()),
+        static_cast<uint32_t>(method.size()), bodySize, 0};
+    return ring.Write({
+        std::span(reinterpret_cast<const char*>(&header), sizeof(header)),
+        std::span(service.data(), service.size()),
+        std::span(method.data(), method.size()),
+        std::span(body.data(), body.size())}, absl::Now() + absl::Seconds(10));
+}
+
+} // namespace
+
+void test_shm(bool json) {
+    ShmTestServer server(SegmentName(), 4096);
+    auto requester = trpc::ShmRequester::make(SegmentName(), absl::Seconds(5));
+    ASSERT_TRUE(requester.ok()) << requester.status();
+    WSProviderClient cli(requester.value(), json);
+
+    // Enough calls to wrap around the rings a few times
+    for (int i = 0; i < 1000; i++) {
+        WeatherStationId req;
+        req.set_id("Station" + std::to_string(i));
+        auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+        ASSERT_TRUE(res.ok()) << res.status();
+        EXPECT_EQ(req.id(), res.value()->ws_id().id());
+        delete res.value();
+    }
+
+    // The errors are passed along with their payloads
+    WeatherStationId req;
+    req.set_id("Missing");
+    auto res = cli.DeleteWeatherStation(nullptr, nullptr, &req);
+    EXPECT_TRUE(absl::IsNotFound(res.status()));
+    EXPECT_EQ("No such station", res.status().message());
+    EXPECT_EQ("a long explanation", res.status().GetPayload("details").value().Flatten());
+
+    // The validation errors are returned before the method is called
+    req.set_id(std::string(300, 'a'));
+    res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    EXPECT_TRUE(absl::IsInvalidArgument(res.status()));
+    EXPECT_TRUE(res.status().GetPayload("violation.id").has_value());
+
+    // Messages that don't fit into the ring are rejected
+    WeatherStation station;
+    station.mutable_ws_id()->set_id(std::string(5000, 'a'));
+    auto updRes = cli.UpdateWeatherStation(nullptr, nullptr, &station);
+    EXPECT_TRUE(absl::IsOutOfRange(updRes.status()));
+
+    // Only one client can be attached
+    EXPECT_TRUE(absl::IsFailedPrecondition(trpc::ShmRequester::make(SegmentName()).status()));
+
+    // The live segment is not replaced by another server
+    EXPECT_TRUE(absl::IsAlreadyExists(trpc::ShmServer::make(SegmentName()).status()));
+
+    server.Stop();
+    req.set_id("Stopped");
+    res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    EXPECT_TRUE(absl::IsUnavailable(res.status()));
+}
+
+TEST(ShmTests, roundtrip_protobuf) {
+    test_shm(false);
+}
+
+TEST(ShmTests, roundtrip_json) {
+    test_shm(true);
+}
+
+TEST(ShmTests, dead_client_takeover) {
+    ShmTestServer server(SegmentName(), 4096);
+
+    // Attach from a child process that is killed without detaching. Only the async-signal-safe calls
+    // are made in the child.
+    std::string name = SegmentName();
+    int ready[2];
+    ASSERT_EQ(0, pipe(ready));
+    pid_t child = fork();
+    if (child == 0) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        char attached = fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0;
+        if (write(ready[1], &attached, 1) == 1) {
+            pause();
+        }
+        _exit(0);
+    }
+    char attached = 0;
+    EXPECT_EQ(1, read(ready[0], &attached, 1));
+    EXPECT_TRUE(attached);
+    EXPECT_TRUE(absl::IsFailedPrecondition(trpc::ShmRequester::make(name).status()));
+    kill(child, SIGKILL);
+    ASSERT_EQ(child, waitpid(child, nullptr, 0));
+    close(ready[0]);
+    close(ready[1]);
+
+    auto requester = trpc::ShmRequester::make(SegmentName(), absl::Seconds(5));
+    ASSERT_TRUE(requester.ok()) << requester.status();
+    WSProviderClient cli(requester.value(), false);
+    WeatherStationId req;
+    req.set_id("TakenOver");
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(res.ok()) << res.status();
+    delete res.value();
+}
+
+TEST(ShmTests, stale_responses) {
+    ShmTestServer server(SegmentName(), 4096, false);
+
+    // The first client times out before the server starts, its response is left in the ring
+    {
+        auto first = trpc::ShmRequester::make(SegmentName(), absl::Milliseconds(50));
+        ASSERT_TRUE(first.ok()) << first.status();
+        WSProviderClient cli(first.value(), false);
+        WeatherStationId req;
+        req.set_id("First");
+        EXPECT_TRUE(absl::IsDeadlineExceeded(cli.FindWeatherStation(nullptr, nullptr, &req).status()));
+    }
+    server.Start();
+
+    // The next client skips the response to the previous client's call
+    auto second = trpc::ShmRequester::make(SegmentName(), absl::Seconds(5));
+    ASSERT_TRUE(second.ok()) << second.status();
+    WSProviderClient cli(second.value(), false);
+    WeatherStationId req;
+    req.set_id("Second");
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(res.ok()) << res.status();
+    EXPECT_EQ("Second", res.value()->ws_id().id());
+    delete res.value();
+}
+
+TEST(ShmTests, malformed_requests) {
+    ShmTestServer server(SegmentName(), 4096);
+    auto segment = trpc::ShmSegment::Open(SegmentName());
+    ASSERT_TRUE(segment.ok()) << segment.status();
+    trpc::ShmRing requests = segment.value()->Requests();
+
+    // A message shorter than the header is dropped
+    ASSERT_TRUE(requests.Write({std::span<const char>("xx", 2)}, absl::Now() + absl::Seconds(10)).ok());
+    // A message with the wrong part sizes is answered with an error
+    ASSERT_TRUE(WriteRawRequest(requests, 777, "FindWeatherStation", "", 1000000).ok());
+    // A corrupted ring position drops the ring contents
+    auto *control = &segment.value()->Header()->requests_;
+    control->head_.store(control->head_.load() + 1000000);
+    control->written_.fetch_add(1);
+    trpc::FutexWakeAll(&control->written_);
+
+    // The server keeps serving, the requester skips the response to the malformed call
+    auto requester = trpc::ShmRequester::make(SegmentName(), absl::Seconds(5));
+    ASSERT_TRUE(requester.ok()) << requester.status();
+    WSProviderClient cli(requester.value(), false);
+    WeatherStationId req;
+    req.set_id("AfterMalformed");
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(res.ok()) << res.status();
+    EXPECT_EQ("AfterMalformed", res.value()->ws_id().id());
+    delete res.value();
+}
+
+TEST(ShmTests, unread_responses) {
+    ShmTestServer server(SegmentName(), 4096, false);
+    server.Get().SetResponseTimeout(absl::Milliseconds(20));
+    server.Start();
+    auto segment = trpc::ShmSegment::Open(SegmentName());
+    ASSERT_TRUE(segment.ok()) << segment.status();
+    trpc::ShmRing requests = segment.value()->Requests();
+
+    // The responses are never read, so the response ring fills up and the server drops the rest
+    WeatherStationId req;
+    req.set_id(std::string(200, 'u'));
+    std::string body = req.SerializeAsString();
+    for (uint64_t i = 0; i < 40; i++) {
+        ASSERT_TRUE(WriteRawRequest(requests, 1000 + i, "FindWeatherStation", body,
+            static_cast<uint32_t>(body.size())).ok());
+    }
+
+    // The server is not stuck, the next client gets its response
+    auto requester = trpc::ShmRequester::make(SegmentName(), absl::Seconds(5));
+    ASSERT_TRUE(requester.ok()) << requester.status();
+    WSProviderClient cli(requester.value(), false);
+    req.set_id("Read");
+    auto res = cli.FindWeatherStation(nullptr, nullptr, &req);
+    ASSERT_TRUE(res.ok()) << res.status();
+    EXPECT_EQ("Read", res.value()->ws_id().id());
+    delete res.value();
+}